@@ -0,0 +1,233 @@
+// Core kernel benchmarks: loading, rendering, highlighting, drawing and
+// saving, each timed on synthetic C sources of different shapes. Prints one
+// JSON document, one result per line, to compare runs across versions,
+// followed by what the cached rows hold in memory for each corpus.
+//
+//   cmake --build build --target glyph_bench && ./build/glyph_bench [scale]
+//
+// scale multiplies the size of every corpus, 1 by default. Each result is
+// the best of several timed runs of at least GLYPH_BENCH_MIN_MS together,
+// each repeating the kernel for at least GLYPH_BENCH_RUN_MS.
+
+#define GLYPH_NO_MAIN
+#include "glyph.cpp"
+
+#define GLYPH_BENCH_MIN_MS 300
+#define GLYPH_BENCH_RUN_MS 5
+#define GLYPH_BENCH_SAMPLE 1000 // rows the per-row kernels run over
+
+struct benchCorpus {
+    const char *name;
+    long lines;
+    void (*line)(FILE *fp, long j);
+};
+
+// About 3 KB of statements per line
+static void benchLongLine(FILE *fp, long j) {
+    for (int k = 0; k < 60; k++) {
+        fprintf(fp, "value%d = compute(x%ld, %d) + \"s\"; ", k, j, k * 7);
+    }
+    fputc('\n', fp);
+}
+
+// Indented with tabs and aligned with tabs in the middle of the line
+static void benchTabLine(FILE *fp, long j) {
+    int depth = 1 + j % 6;
+    for (int k = 0; k < depth; k++) fputc('\t', fp);
+    fprintf(fp, "if (flags & %ld)\t{\tcount\t+= %ld;\t}\t// step %ld\n", j & 0xff, j % 13, j);
+}
+
+// Mostly block comments, with code that is commented out in them
+static void benchCommentLine(FILE *fp, long j) {
+    switch (j % 10) {
+        case 0: fprintf(fp, "/* Section %ld: return values are checked\n", j / 10); break;
+        case 9: fprintf(fp, " * end of section */ int s%ld = %ld;\n", j, j); break;
+        default: fprintf(fp, " * int old%ld = lookup(\"key\", %ld); // unused\n", j, j % 100); break;
+    }
+}
+
+static void benchShortLine(FILE *fp, long j) {
+    switch (j % 4) {
+        case 0: fprintf(fp, "int v%ld = %ld;\n", j, j % 1000); break;
+        case 1: fprintf(fp, "v%ld++;\n", j - 1); break;
+        case 2: fprintf(fp, "// %ld\n", j); break;
+        case 3: fprintf(fp, "}\n"); break;
+    }
+}
+
+static benchCorpus corpora[] = {
+    { "long_lines", 5000, benchLongLine },
+    { "tab_heavy", 200000, benchTabLine },
+    { "comment_heavy", 200000, benchCommentLine },
+    { "rows_1m", 1000000, benchShortLine },
+};
+
+static int benchFirst = 1;
+static std::string benchMemory; // row memory after each corpus, printed last
+
+// Times fn, which handles ops items and bytes bytes per call, and prints
+// the best run
+template<typename F>
+static void benchRun(const char *corpus, const char *kernel, size_t ops, size_t bytes, F fn) {
+    // Calls per run, so the clock's resolution does not matter
+    long reps = 1;
+    while (1) {
+        long long start = editorNowUs();
+        for (long k = 0; k < reps; k++) fn();
+        if (editorNowUs() - start >= GLYPH_BENCH_RUN_MS * 1000LL) break;
+        reps *= 2;
+    }
+
+    double best = -1;
+    long long spent = 0;
+    int runs = 0;
+    while (runs < 3 || spent < GLYPH_BENCH_MIN_MS * 1000LL) {
+        long long start = editorNowUs();
+        for (long k = 0; k < reps; k++) fn();
+        long long us = editorNowUs() - start;
+        if (best < 0 || (double)us / reps < best) best = (double)us / reps;
+        spent += us;
+        runs++;
+    }
+    printf("%s\n    {\"corpus\": \"%s\", \"kernel\": \"%s\", \"runs\": %d, \"reps\": %ld, \"ops\": %zu, "
+        "\"bytes\": %zu, \"ns_per_op\": %.1f, \"mb_per_s\": %.1f}",
+        benchFirst ? "" : ",", corpus, kernel, runs, reps, ops, bytes,
+        best * 1000.0 / (ops ? ops : 1), (double)bytes / best);
+    benchFirst = 0;
+    fflush(stdout);
+}
+
+static void benchCorpusRun(const benchCorpus &c, long scale) {
+    char path[32], out[32];
+    strcpy(path, "/tmp/glyph_benchXXXXXX.c");
+    int fd = mkstemps(path, 2);
+    if (fd == -1) die("mkstemps");
+    FILE *fp = fdopen(fd, "w");
+    long lines = c.lines * scale;
+    for (long j = 0; j < lines; j++) c.line(fp, j);
+    fclose(fp);
+    strcpy(out, "/tmp/glyph_saveXXXXXX.c");
+    fd = mkstemps(out, 2);
+    if (fd == -1) die("mkstemps");
+    close(fd);
+
+    openEditor(path);
+    editorWaitLoaded();
+    size_t size = E.doc.length();
+    benchRun(c.name, "openEditor", E.numrows, size, [&]() {
+        openEditor(path);
+        editorWaitLoaded();
+    });
+
+    benchRun(c.name, "editorRowsToString", E.numrows, size, [&]() {
+        size_t len;
+        free(editorRowsToString(&len));
+    });
+
+    // Written beside the corpus, which stays mapped
+    free(E.filename);
+    E.filename = strdup(out);
+    benchRun(c.name, "editorSave", E.numrows, size, [&]() {
+        editorSave();
+        editorFinishSave();
+        if (E.saveerr) die("editorSave");
+    });
+
+    // The syntax worker's pass over the whole document
+    benchRun(c.name, "editorSyntaxStep", E.numrows, size, [&]() {
+        E.hlfront = 0;
+        E.hldirty.clear();
+        E.rowoff = E.numrows;
+        while (editorSyntaxStep());
+        E.rowoff = 0;
+    });
+
+    std::vector<erow *> rows;
+    size_t rowbytes = 0;
+    int step = E.numrows > GLYPH_BENCH_SAMPLE ? E.numrows / GLYPH_BENCH_SAMPLE : 1;
+    for (int at = 0; at < E.numrows && rows.size() < GLYPH_BENCH_SAMPLE; at += step) {
+        rows.push_back(editorRowAt(at));
+        rowbytes += rows.back() -> size;
+    }
+
+    // An edited row: its end state rescanned, then rendered and highlighted
+    benchRun(c.name, "editorUpdateRow", rows.size(), rowbytes, [&]() {
+        for (erow *row : rows) editorUpdateRow(row);
+        editorSyntaxFlush();
+        for (erow *row : rows) editorPrepareRow(row);
+    });
+
+    benchRun(c.name, "editorHighlightRow", rows.size(), rowbytes, [&]() {
+        for (erow *row : rows) {
+            editorHighlightRow(row, row -> idx > 0 ? E.hlstate[row -> idx - 1] : 0);
+        }
+    });
+
+    // The cursor at the end of the row, the longest walk
+    volatile int sink = 0;
+    benchRun(c.name, "editorRowCxToRx", rows.size(), rowbytes, [&]() {
+        for (erow *row : rows) sink += editorRowCxToRx(row, row -> size);
+    });
+
+    // A full repaint of the same screen, every row already cached
+    E.screen.resize(E.screenrows + 2);
+    E.line.reserve(E.screencols * (SGR_LEN + 1) + 32);
+    E.rowoff = E.numrows / 2;
+    editorDrawRows(E.frame, E.line);
+    benchRun(c.name, "editorDrawRows", E.screenrows, E.frame.size(), [&]() {
+        E.screen.invalidate();
+        E.frame.clear();
+        editorDrawRows(E.frame, E.line);
+    });
+
+    // Paging through the document, so every row is built on the way
+    int pages = 50;
+    size_t paged = 0;
+    auto page = [&]() {
+        paged = 0;
+        for (int k = 0; k < pages; k++) {
+            E.rowoff = (E.rowoff + E.screenrows) % E.numrows;
+            E.screen.invalidate();
+            E.frame.clear();
+            editorDrawRows(E.frame, E.line);
+            paged += E.frame.size();
+            editorTrimRows();
+        }
+    };
+    page();
+    benchRun(c.name, "editorDrawRows_paging", (size_t)pages * E.screenrows, paged, page);
+    E.rowoff = 0;
+
+    editorRowMemory m;
+    editorRowMemoryStats(&m);
+    char buf[512];
+    snprintf(buf, sizeof(buf), "%s\n    {\"corpus\": \"%s\", \"rows\": %zu, \"chars\": [%zu, %zu], "
+        "\"render\": [%zu, %zu], \"hl\": [%zu, %zu], \"headers\": %zu, \"pool_used\": %zu, "
+        "\"pool_reserved\": %zu, \"large\": %zu}",
+        benchMemory.empty() ? "" : ",", c.name, m.rows, m.chars, m.charsCap, m.render, m.renderCap,
+        m.hl, m.hlCap, m.headers, m.pool.used, m.pool.reserved, m.pool.large);
+    benchMemory += buf;
+
+    editorFreeRows();
+    editorReleaseDocBuf();
+    unlink(path);
+    unlink(out);
+}
+
+int main(int argc, char *argv[]) {
+    long scale = argc > 1 ? atol(argv[1]) : 1;
+    if (scale < 1) scale = 1;
+
+    E.headless = 1;
+    E.screenrows = 50;
+    E.screencols = 160;
+    initEditor();
+
+    printf("{\"version\": \"" GLYPH_VERSION "\", \"scale\": %ld, \"screen\": [%d, %d], \"results\": [",
+        scale, E.screenrows + 2, E.screencols);
+    for (const benchCorpus &c : corpora) benchCorpusRun(c, scale);
+    // Bytes used and reserved per category for the rows cached at the end
+    printf("\n], \"memory\": [%s\n]}\n", benchMemory.c_str());
+    editorShutdown();
+    return 0;
+}
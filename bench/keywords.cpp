@@ -0,0 +1,111 @@
+// Keyword matching microbenchmark: the perfect hash in src/Keywords.h
+// against the linear scan over the keyword list that editorHighlightRow used
+// to do at every word start. Uses the C++ keyword set.
+//
+//   g++ -std=c++17 -O2 -Isrc bench/keywords.cpp -o kwbench && ./kwbench
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include "Keywords.h"
+
+static const char *CPP_keywords[] = {
+    "alignas", "alignof", "and", "and_eq", "asm", "bitand", "bitor", "break",
+    "case", "catch", "class", "compl", "concept", "const_cast", "consteval",
+    "constexpr", "constinit", "continue", "co_await", "co_return", "co_yield",
+    "decltype", "default", "delete", "do", "dynamic_cast", "else", "enum",
+    "explicit", "export", "extern", "false", "for", "friend", "goto", "if",
+    "inline", "mutable", "namespace", "new", "noexcept", "not", "not_eq",
+    "nullptr", "operator", "or", "or_eq", "private", "protected", "public",
+    "register", "reinterpret_cast", "requires", "return", "sizeof", "static",
+    "static_assert", "static_cast", "struct", "switch", "template", "this",
+    "thread_local", "throw", "true", "try", "typedef", "typeid", "typename",
+    "union", "using", "virtual", "volatile", "while", "xor", "xor_eq",
+    "override", "final", "import", "module",
+    "auto|", "bool|", "char|", "char8_t|", "char16_t|", "char32_t|", "const|",
+    "double|", "float|", "int|", "long|", "short|", "signed|", "unsigned|",
+    "void|", "wchar_t|", "size_t|", "int8_t|", "int16_t|", "int32_t|",
+    "int64_t|", "uint8_t|", "uint16_t|", "uint32_t|", "uint64_t|", NULL
+};
+
+static int is_separator(int c) {
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+// The matcher editorHighlightRow had before the keyword table
+static int linearLookup(const char *s) {
+    for (int j = 0; CPP_keywords[j]; j++) {
+        int klen = strlen(CPP_keywords[j]);
+        int kw2 = CPP_keywords[j][klen - 1] == '|';
+        if (kw2) klen--;
+        if (!strncmp(s, CPP_keywords[j], klen) && is_separator(s[klen])) return kw2 ? 2 : 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    size_t words = argc > 1 ? strtoull(argv[1], NULL, 10) : 2000000;
+    size_t nkw = 0;
+    while (CPP_keywords[nkw]) nkw++;
+
+    // Source-like text: roughly one word in four is a keyword
+    static const char *idents[] = { "x", "count", "buffer", "editorRow", "i",
+        "render", "size", "ptr", "node", "value", "intx", "returned" };
+    std::string text;
+    unsigned int seed = 12345;
+    for (size_t j = 0; j < words; j++) {
+        seed = seed * 1103515245 + 12345;
+        unsigned int r = seed >> 8;
+        if (r % 4 == 0) text += CPP_keywords[r % nkw];
+        else text += idents[r % 12];
+        if (!text.empty() && text.back() == '|') text.pop_back();
+        text += (r & 64) ? " " : "(";
+    }
+    std::vector<size_t> starts;
+    for (size_t j = 0; j < text.size(); j++) {
+        if (j == 0 || is_separator(text[j - 1])) starts.push_back(j);
+    }
+
+    auto t0 = std::chrono::steady_clock::now();
+    KeywordTable table;
+    table.build(CPP_keywords);
+    auto t1 = std::chrono::steady_clock::now();
+
+    const char *s = text.c_str();
+    size_t hits[2] = { 0, 0 };
+    int kinds[2] = { 0, 0 };
+    double ns[2];
+    for (int pass = 0; pass < 2; pass++) {
+        auto a = std::chrono::steady_clock::now();
+        for (size_t at : starts) {
+            int kind;
+            if (pass == 0) {
+                kind = linearLookup(s + at);
+            } else {
+                size_t end = at;
+                while (!is_separator(s[end])) end++;
+                kind = table.lookup(s + at, end - at);
+            }
+            if (kind) hits[pass]++;
+            kinds[pass] += kind;
+        }
+        auto b = std::chrono::steady_clock::now();
+        ns[pass] = std::chrono::duration<double, std::nano>(b - a).count() / starts.size();
+    }
+
+    printf("keywords      %zu\n", nkw);
+    printf("words         %zu\n", starts.size());
+    printf("build         %.1f us\n", std::chrono::duration<double, std::micro>(t1 - t0).count());
+    printf("linear        %.1f ns/word\n", ns[0]);
+    printf("perfect hash  %.1f ns/word\n", ns[1]);
+    printf("speedup       %.1fx\n", ns[0] / ns[1]);
+    if (hits[0] != hits[1] || kinds[0] != kinds[1]) {
+        printf("MISMATCH: %zu/%d keywords vs %zu/%d\n", hits[0], kinds[0], hits[1], kinds[1]);
+        return 1;
+    }
+    return 0;
+}
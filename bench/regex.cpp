@@ -0,0 +1,148 @@
+// Regex search microbenchmark: the lazy DFA in src/Regex.h, run the way the
+// match index runs it, against std::regex_search on each line. The corpus is
+// a synthetic server log, searched for timestamps, request IDs and error
+// codes. Both sides count the lines that hold a match. The same log is then
+// run together into one minified line of about 100 KB and every match in it
+// listed, where a pattern whose DFA stays alive to the end of the line must
+// not cost more than one that dies early.
+//
+//   g++ -std=c++17 -O2 -Isrc bench/regex.cpp -o rebench && ./rebench [lines]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <regex>
+#include <chrono>
+#include "Regex.h"
+
+static const char *patterns[] = {
+    "[0-9]{4}-[0-9]{2}-[0-9]{2} [0-9]{2}:[0-9]{2}:[0-9]{2}",
+    "req=[0-9a-f]{8} ",
+    "ERROR E[0-9]{4}",
+    "E040[0-9]|E050[0-3]",
+    "timeout after [0-9]+ms$",
+    "^2024-03-1[0-9] 0[0-9]:",
+    "user=[a-z]+[0-9]+ .*denied",
+    NULL
+};
+
+// Run over the single long line. The second branch of each keeps its DFA
+// alive to the end of the line wherever the first one matches.
+static const char *longPatterns[] = {
+    "req=[0-9a-f]{8}",
+    "req=[0-9a-f]{8}|req=.*denied!",
+    "E[0-9]{4}|E.*timeout after 0ms$",
+    "[a-z]+[0-9]+|user=.*;;",
+    NULL
+};
+
+#define LONG_LINE (100 * 1024)
+
+int main(int argc, char *argv[]) {
+    size_t lines = argc > 1 ? strtoull(argv[1], NULL, 10) : 200000;
+
+    static const char *levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+    static const char *events[] = { "request served", "cache miss", "timeout after %ums",
+        "access denied", "retrying", "connection reset" };
+    std::string text;
+    char buf[256];
+    unsigned int seed = 12345;
+    for (size_t j = 0; j < lines; j++) {
+        unsigned int r[6];
+        for (int k = 0; k < 6; k++) {
+            seed = seed * 1103515245 + 12345;
+            r[k] = seed >> 8;
+        }
+        int n = snprintf(buf, sizeof(buf), "2024-03-%02u %02u:%02u:%02u.%03u %s",
+            r[0] % 28 + 1, r[0] / 28 % 24, r[1] % 60, r[1] / 60 % 60, r[2] % 1000, levels[r[2] / 1000 % 6]);
+        if (levels[r[2] / 1000 % 6][0] == 'E') n += snprintf(buf + n, sizeof(buf) - n, " E%04u", r[3] % 600);
+        n += snprintf(buf + n, sizeof(buf) - n, " req=%08x user=%s%u ", r[4], r[5] & 1 ? "svc" : "admin", r[5] % 100);
+        n += snprintf(buf + n, sizeof(buf) - n, events[r[3] / 600 % 6], r[5] % 5000);
+        text.append(buf, n);
+        text += '\n';
+    }
+    double mb = text.size() / 1e6;
+
+    printf("corpus        %zu lines, %.1f MB\n", lines, mb);
+    int mismatches = 0;
+    for (int i = 0; patterns[i]; i++) {
+        const char *pat = patterns[i];
+        std::string error;
+        Regex re;
+        if (!re.compile(pat, strlen(pat), false, error)) {
+            printf("%s: %s\n", pat, error.c_str());
+            return 1;
+        }
+
+        // A block at a time, as editorFindRegexWorker feeds it
+        auto a = std::chrono::steady_clock::now();
+        size_t ours = 0;
+        size_t lineEnd = 0;
+        RegexStream stream(re, 0);
+        const size_t block = 1 << 20;
+        for (size_t at = 0; at < text.size(); at += block) {
+            size_t n = text.size() - at < block ? text.size() - at : block;
+            stream.feed(text.data() + at, n, [&](size_t off) {
+                if (off >= lineEnd) {
+                    ours++;
+                    lineEnd = (const char *)memchr(text.data() + off, '\n', text.size() - off) - text.data();
+                }
+                return true;
+            });
+        }
+        auto b = std::chrono::steady_clock::now();
+
+        std::regex sre(pat, std::regex::ECMAScript | std::regex::optimize);
+        size_t theirs = 0;
+        const char *s = text.data();
+        const char *end = s + text.size();
+        while (s < end) {
+            const char *nl = (const char *)memchr(s, '\n', end - s);
+            if (std::regex_search(s, nl, sre)) theirs++;
+            s = nl + 1;
+        }
+        auto c = std::chrono::steady_clock::now();
+
+        double us = std::chrono::duration<double>(b - a).count();
+        double them = std::chrono::duration<double>(c - b).count();
+        printf("%-56s %7zu lines  dfa %7.1f MB/s  std::regex %6.1f MB/s  %5.1fx  literal \"%s\"\n",
+            pat, ours, mb / us, mb / them, them / us, re.literal().c_str());
+        if (ours != theirs) {
+            printf("MISMATCH: %zu lines vs %zu\n", ours, theirs);
+            mismatches++;
+        }
+    }
+
+    // The log as one line, records separated by spaces
+    std::string longLine = text.substr(0, LONG_LINE);
+    for (char &c : longLine) {
+        if (c == '\n') c = ' ';
+    }
+    printf("long line     %zu KB\n", longLine.size() / 1024);
+    for (int i = 0; longPatterns[i]; i++) {
+        const char *pat = longPatterns[i];
+        std::string error;
+        Regex re;
+        if (!re.compile(pat, strlen(pat), false, error)) {
+            printf("%s: %s\n", pat, error.c_str());
+            return 1;
+        }
+        double best = -1;
+        size_t count = 0;
+        for (int run = 0; run < 5; run++) {
+            auto a = std::chrono::steady_clock::now();
+            count = 0;
+            re.lineMatches(longLine.data(), longLine.size(), [&](size_t, size_t) {
+                count++;
+                return true;
+            });
+            double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - a).count();
+            if (best < 0 || t < best) best = t;
+        }
+        printf("%-56s %7zu matches  %7.2f ms  %7.1f MB/s\n", pat, count, best * 1000,
+            longLine.size() / 1e6 / best);
+    }
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,429 @@
+// Headless replay: drives the editor with a scripted key stream on a virtual
+// terminal and reports how long each key took to handle and draw, and how
+// many bytes its frames sent. The editor runs unchanged except that its
+// output goes to E.sink and its input comes from the script, one key at a
+// time, each followed by the frame the main loop draws for it.
+//
+//   g++ -std=c++17 -O2 -Isrc bench/replay.cpp -o glyph_replay -pthread
+//   ./glyph_replay [-s script | -g scenario] [-r rows] [-c cols] [-t ms]
+//                  [-n lines] [-j] [file]
+//
+// -s reads a script, -g picks a built-in one (typing, enter, comment,
+// scroll, search, undo, split, paste or all, the default). -n writes a synthetic C file
+// of that many lines to edit instead of file. -t idles between keys, so
+// timers and the syntax worker run as they would while someone types.
+// -j prints JSON instead of a table. A script has one command per line:
+//
+//   section <name>      later keys are reported under name
+//   type <text>         each character is a key
+//   key <name> [count]  enter tab backspace del esc up down left right
+//                       home end pgup pgdn, or ctrl-<letter>
+//   paste <text>        one bracketed paste, where \n, \t and \\ stand for a
+//                       line break, a tab and a backslash
+//   wait <ms>           idles before the next key
+//   check               exits with 1 unless the comment states agree with a
+//                       lex of the whole document, once the worker settles
+
+#define GLYPH_NO_MAIN
+#include "glyph.cpp"
+#include <algorithm>
+
+struct replayKey {
+    std::string bytes;
+    int wait;    // ms to idle before it
+    int section;
+    int check = 0; // script line of a check to run before it
+};
+
+struct replaySection {
+    std::string name;
+    std::vector<long long> us; // latency of each key
+    std::vector<size_t> bytes; // sent by each key's frames
+    size_t frames = 0;
+};
+
+static struct {
+    std::vector<replayKey> keys;
+    std::vector<replaySection> sections;
+    size_t next;
+    int think;
+    int json;
+    int check;        // line of a check that waits for the next key
+    long long start;  // editorNowUs() when the current key went in
+    size_t frames;    // E.screen.frames then
+    std::string file;
+    long long openus;
+    char temp[32];
+} R;
+
+static const struct { const char *name; const char *bytes; } replayKeyNames[] = {
+    { "enter", "\r" }, { "tab", "\t" }, { "backspace", "\x7f" }, { "del", "\x1b[3~" },
+    { "esc", "\x1b" }, { "up", "\x1b[A" }, { "down", "\x1b[B" }, { "right", "\x1b[C" },
+    { "left", "\x1b[D" }, { "home", "\x1b[H" }, { "end", "\x1b[F" }, { "pgup", "\x1b[5~" },
+    { "pgdn", "\x1b[6~" },
+};
+
+static const char *replayScenarios[][2] = {
+    { "typing",
+        "section typing\n"
+        "key down 20\n"
+        "type     int replayed = compute(values, count) + 42; // typed\n"
+        "key enter\n"
+        "type     if (replayed > 0) return \"positive\";\n"
+        "key enter\n"
+        "key backspace 40\n" },
+    { "enter",
+        "section enter\n"
+        "key end\n"
+        "key enter 100\n"
+        "key backspace 100\n" },
+    { "comment",
+        "section comment\n"
+        "key home\n"
+        "type /*\n"
+        "key backspace 2\n"
+        "type /*\n"
+        "key backspace 2\n"
+        "type /*\n"
+        "key backspace 2\n" },
+    { "scroll",
+        "section scroll\n"
+        "key pgdn 200\n"
+        "key down 500\n"
+        "key pgup 200\n" },
+    { "search",
+        "section search\n"
+        "key ctrl-f\n"
+        "type return\n"
+        "key down 20\n"
+        "key up 5\n"
+        "key enter\n"
+        "key ctrl-f\n"
+        "type nomatchanywhere\n"
+        "key esc\n" },
+    { "undo",
+        "section undo\n"
+        "key ctrl-z 60\n"
+        "key ctrl-y 20\n" },
+    // Splitting a line so that a comment opens on the new row
+    { "split",
+        "section split\n"
+        "key down 3\n"
+        "key end\n"
+        "type  /* open\n"
+        "key left 7\n"
+        "key enter\n"
+        "check\n"
+        "key backspace\n"
+        "check\n"
+        "key end\n"
+        "key backspace 8\n"
+        "check\n" },
+    { "paste",
+        "section paste\n"
+        "key down 40\n"
+        "key end\n"
+        "key enter\n"
+        "paste static int pasted(int n) {\\n\\t/* pasted\\n\\t * block */\\n\\treturn n * 2;\\n}\\n\n"
+        "check\n"
+        "key ctrl-z\n"
+        "check\n" },
+};
+
+static int replayFindSection(const std::string &name) {
+    for (size_t j = 0; j < R.sections.size(); j++) {
+        if (R.sections[j].name == name) return j;
+    }
+    R.sections.push_back(replaySection());
+    R.sections.back().name = name;
+    return R.sections.size() - 1;
+}
+
+// The text of a paste command with its escapes resolved
+static std::string replayUnescape(const std::string &arg) {
+    std::string out;
+    for (size_t j = 0; j < arg.size(); j++) {
+        if (arg[j] != '\\' || j + 1 == arg.size()) {
+            out += arg[j];
+            continue;
+        }
+        switch (arg[++j]) {
+            case 'n': out += '\n'; break;
+            case 't': out += '\t'; break;
+            default: out += arg[j]; break;
+        }
+    }
+    return out;
+}
+
+static int replayParse(const std::string &script) {
+    int section = R.sections.empty() ? replayFindSection("keys") : R.sections.size() - 1;
+    int wait = 0;
+    size_t at = 0;
+    int lineno = 0;
+    while (at < script.size()) {
+        size_t nl = script.find('\n', at);
+        if (nl == std::string::npos) nl = script.size();
+        std::string line = script.substr(at, nl - at);
+        at = nl + 1;
+        lineno++;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+        size_t sp = line.find(' ');
+        std::string cmd = line.substr(0, sp);
+        std::string arg = sp == std::string::npos ? "" : line.substr(sp + 1);
+
+        if (cmd == "section") {
+            section = replayFindSection(arg);
+        } else if (cmd == "wait") {
+            wait += atoi(arg.c_str());
+        } else if (cmd == "check") {
+            R.check = lineno;
+        } else if (cmd == "type") {
+            for (char c : arg) {
+                R.keys.push_back(replayKey{ std::string(1, c), wait, section, R.check });
+                wait = R.check = 0;
+            }
+        } else if (cmd == "paste") {
+            R.keys.push_back(replayKey{ "\x1b[200~" + replayUnescape(arg) + "\x1b[201~", wait, section, R.check });
+            wait = R.check = 0;
+        } else if (cmd == "key") {
+            size_t sp2 = arg.find(' ');
+            std::string name = arg.substr(0, sp2);
+            int count = sp2 == std::string::npos ? 1 : atoi(arg.c_str() + sp2 + 1);
+            std::string bytes;
+            if (name.size() == 6 && name.compare(0, 5, "ctrl-") == 0) {
+                bytes = std::string(1, CTRL_KEY(name[5]));
+            }
+            for (const auto &k : replayKeyNames) {
+                if (name == k.name) bytes = k.bytes;
+            }
+            if (bytes.empty()) {
+                fprintf(stderr, "line %d: unknown key %s\n", lineno, name.c_str());
+                return -1;
+            }
+            while (count-- > 0) {
+                R.keys.push_back(replayKey{ bytes, wait, section, R.check });
+                wait = R.check = 0;
+            }
+        } else {
+            fprintf(stderr, "line %d: unknown command %s\n", lineno, cmd.c_str());
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// A C file with comments, strings, numbers and tabs on a mix of line lengths
+static int replayWriteCorpus(long lines) {
+    // The extension picks C highlighting
+    strcpy(R.temp, "/tmp/glyph_replayXXXXXX.c");
+    int fd = mkstemps(R.temp, 2);
+    if (fd == -1) return -1;
+    FILE *fp = fdopen(fd, "w");
+    for (long j = 0; j < lines; j++) {
+        switch (j % 12) {
+            case 0: fprintf(fp, "/* Block %ld: a comment that runs\n", j / 12); break;
+            case 1: fprintf(fp, " * over two lines */\n"); break;
+            case 2: fprintf(fp, "static int handler%ld(struct request *req, int flags) {\n", j); break;
+            case 3: fprintf(fp, "\tint count = %ld; // line comment\n", j * 7 % 1000); break;
+            case 4: fprintf(fp, "\tconst char *name = \"handler %ld\";\n", j); break;
+            case 5: fprintf(fp, "\tif (flags & 0x%lx) count += req -> size;\n", j & 0xff); break;
+            case 6: fprintf(fp, "\tfor (int i = 0; i < count; i++) {\n"); break;
+            case 7: fprintf(fp, "\t\treq -> data[i] = (char)(i * %ld + 3.5);\n", j % 97); break;
+            case 8: fprintf(fp, "\t}\n"); break;
+            case 9: fprintf(fp, "\treturn count > 0 ? count : -1;\n"); break;
+            case 10: fprintf(fp, "}\n"); break;
+            case 11: fprintf(fp, "\n"); break;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+static long long replayPercentile(std::vector<long long> v, int p) {
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    return v[(v.size() - 1) * p / 100];
+}
+
+static void replayReport() {
+    if (R.temp[0]) unlink(R.temp);
+    replaySection all;
+    all.name = "all";
+    std::vector<replaySection *> list;
+    for (replaySection &s : R.sections) {
+        if (s.us.empty()) continue;
+        list.push_back(&s);
+        all.us.insert(all.us.end(), s.us.begin(), s.us.end());
+        all.bytes.insert(all.bytes.end(), s.bytes.begin(), s.bytes.end());
+        all.frames += s.frames;
+    }
+    list.push_back(&all);
+
+    if (R.json) {
+        printf("{\"file\": \"%s\", \"rows\": %d, \"screen\": [%d, %d], \"open_ms\": %.1f, \"sections\": [",
+            R.temp[0] ? "synthetic" : R.file.c_str(), E.numrows, E.screenrows + 2, E.screencols, R.openus / 1000.0);
+    } else {
+        printf("%s, %d rows, %dx%d, opened in %.1f ms\n", R.temp[0] ? "synthetic" : R.file.c_str(),
+            E.numrows, E.screencols, E.screenrows + 2, R.openus / 1000.0);
+        printf("%-10s %7s %10s %10s %10s %8s %12s %12s\n", "section", "keys", "p50 us", "p99 us", "max us",
+            "frames", "bytes/frame", "max bytes");
+    }
+    for (size_t j = 0; j < list.size(); j++) {
+        replaySection &s = *list[j];
+        size_t total = 0, most = 0;
+        for (size_t b : s.bytes) {
+            total += b;
+            if (b > most) most = b;
+        }
+        double perframe = s.frames ? (double)total / s.frames : 0;
+        if (R.json) {
+            printf("%s{\"name\": \"%s\", \"keys\": %zu, \"p50_us\": %lld, \"p99_us\": %lld, \"max_us\": %lld, "
+                "\"frames\": %zu, \"bytes\": %zu, \"bytes_per_frame\": %.1f, \"max_key_bytes\": %zu}",
+                j ? ", " : "", s.name.c_str(), s.us.size(), replayPercentile(s.us, 50),
+                replayPercentile(s.us, 99), replayPercentile(s.us, 100), s.frames, total, perframe, most);
+        } else {
+            printf("%-10s %7zu %10lld %10lld %10lld %8zu %12.1f %12zu\n", s.name.c_str(), s.us.size(),
+                replayPercentile(s.us, 50), replayPercentile(s.us, 99), replayPercentile(s.us, 100),
+                s.frames, perframe, most);
+        }
+    }
+    if (R.json) printf("]}\n");
+    fflush(stdout);
+}
+
+// Lets the syntax worker settle the rows it is after, then lexes the
+// document from the top and compares each settled row's end state
+static void replayCheck(int lineno) {
+    editorSyntaxFlush();
+    while (editorSyntaxNext() < editorSyntaxTarget()) editorWaitEvents(1);
+    int state = 0, r = 0, bad = -1, want = 0;
+    E.doc.forEachLine(0, E.hlfront, [&](const char *s, size_t len) {
+        if (len > 0 && s[len - 1] == '\r') len--;
+        state = editorSyntaxScan(s, len, state);
+        if (bad < 0 && E.hlstate[r] != state) {
+            bad = r;
+            want = state;
+        }
+        r++;
+    });
+    if (bad < 0) return;
+    fprintf(stderr, "check on line %d: row %d ends in state %d, lexes to %d\n",
+        lineno, bad, E.hlstate[bad], want);
+    editorShutdown();
+    exit(1);
+}
+
+// Called by editorReadKey whenever the editor is done with the key before
+static void replayNextKey() {
+    long long now = editorNowUs();
+    if (R.next > 0) {
+        replaySection &s = R.sections[R.keys[R.next - 1].section];
+        s.us.push_back(now - R.start);
+        s.bytes.push_back(E.sink.size());
+        s.frames += E.screen.frames - R.frames;
+    }
+    if (R.next < R.keys.size() && R.keys[R.next].check) replayCheck(R.keys[R.next].check);
+    if (R.next == R.keys.size() || R.keys[R.next].bytes.empty()) {
+        editorShutdown();
+        exit(0);
+    }
+
+    // Timers and background work get their turn outside the measured time
+    const replayKey &k = R.keys[R.next++];
+    long long idle = R.think + k.wait;
+    long long until = editorNow() + idle;
+    do {
+        editorWaitEvents(idle);
+        idle = until - editorNow();
+    } while (idle > 0);
+
+    E.sink.clear();
+    E.input.push(k.bytes.data(), k.bytes.size());
+    R.frames = E.screen.frames;
+    R.start = editorNowUs();
+}
+
+static int usage() {
+    fprintf(stderr, "usage: glyph_replay [-s script | -g scenario] [-r rows] [-c cols] [-t ms] [-n lines] [-j] [file]\n");
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    int rows = 50, cols = 160;
+    long lines = 0;
+    const char *script = NULL, *scenario = "all";
+    int opt;
+    while ((opt = getopt(argc, argv, "s:g:r:c:t:n:j")) != -1) {
+        switch (opt) {
+            case 's': script = optarg; break;
+            case 'g': scenario = optarg; break;
+            case 'r': rows = atoi(optarg); break;
+            case 'c': cols = atoi(optarg); break;
+            case 't': R.think = atoi(optarg); break;
+            case 'n': lines = atol(optarg); break;
+            case 'j': R.json = 1; break;
+            default: return usage();
+        }
+    }
+    if (rows < 3 || cols < 1 || (optind == argc && lines <= 0)) return usage();
+
+    if (script) {
+        FILE *fp = fopen(script, "r");
+        if (!fp) {
+            perror(script);
+            return 1;
+        }
+        std::string text;
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) text.append(buf, n);
+        fclose(fp);
+        if (replayParse(text) == -1) return 1;
+    } else {
+        int found = 0;
+        for (const auto &s : replayScenarios) {
+            if (strcmp(scenario, "all") && strcmp(scenario, s[0])) continue;
+            found = 1;
+            replayParse(s[1]);
+        }
+        if (!found) {
+            fprintf(stderr, "unknown scenario %s\n", scenario);
+            return 1;
+        }
+    }
+
+    // A check after the last key runs before the replay exits
+    if (R.check) R.keys.push_back(replayKey{ "", 0, 0, R.check });
+
+    if (lines > 0) {
+        if (replayWriteCorpus(lines) == -1) die("mkstemps");
+        R.file = R.temp;
+    } else {
+        R.file = argv[optind];
+    }
+
+    E.headless = 1;
+    E.nokey = replayNextKey;
+    E.screenrows = rows;
+    E.screencols = cols;
+    initEditor();
+    E.frameinterval = 0; // a frame for every key, as a slow typist gets
+    editorInitEvents();
+    editorStartSyntax();
+    atexit(replayReport);
+
+    long long start = editorNowUs();
+    openEditor((char *)R.file.c_str());
+    editorWaitLoaded();
+    R.openus = editorNowUs() - start;
+
+    editorRefreshScreen();
+    while (1) {
+        editorProcessKey();
+        while (editorInputPending()) editorProcessKey();
+        editorScheduleRefresh();
+    }
+    return 0;
+}
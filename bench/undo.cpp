@@ -0,0 +1,164 @@
+// Undo journal benchmark: bytes held per recorded edit by src/Journal.h for
+// the kinds of history an editing session makes, against a list of edit
+// records that each own their text, and how long undoing and redoing all of
+// it takes.
+//
+//   g++ -std=c++17 -O2 -Isrc bench/undo.cpp -o undobench && ./undobench [edits]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include "Journal.h"
+
+// What a straightforward undo stack keeps per edit
+struct naiveEdit {
+    int kind;
+    size_t off;
+    std::string text;
+};
+
+static size_t naiveBytes(const std::vector<naiveEdit> &log) {
+    size_t n = log.capacity() * sizeof(naiveEdit);
+    for (const naiveEdit &e : log) {
+        if (e.text.capacity() > 15) n += e.text.capacity() + 1;
+    }
+    return n;
+}
+
+static unsigned int seed = 12345;
+static unsigned int rnd() {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static void report(const char *name, size_t edits, Journal &j, const std::vector<naiveEdit> &naive) {
+    size_t changes = 0, bytes = 0;
+    auto a = std::chrono::steady_clock::now();
+    while (j.undo([&](const jrChange &c) {
+        changes++;
+        bytes += c.kind == JR_REPLACE ? c.edits -> size() : c.len;
+    }));
+    auto b = std::chrono::steady_clock::now();
+    while (j.redo([&](const jrChange &c) {
+        changes++;
+        bytes += c.kind == JR_REPLACE ? c.edits -> size() : c.len;
+    }));
+    auto c = std::chrono::steady_clock::now();
+    printf("%-24s %9zu edits  journal %6.2f B/edit  records %7.2f B/edit  undo all %8.1f us  redo all %8.1f us\n",
+        name, edits, (double)j.bytes() / edits, (double)naiveBytes(naive) / edits,
+        std::chrono::duration<double, std::micro>(b - a).count(),
+        std::chrono::duration<double, std::micro>(c - b).count());
+    if (changes == 0 && bytes == 0) printf("nothing undone\n");
+}
+
+int main(int argc, char *argv[]) {
+    size_t edits = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    size_t doc = 50 << 20; // a 50 MB document
+
+    // Typing: runs of a few words at one place, then the cursor moves
+    {
+        Journal j(1ull << 40);
+        std::vector<naiveEdit> naive;
+        size_t off = 0;
+        for (size_t k = 0; k < edits; k++) {
+            if (k % 40 == 0) {
+                j.cut();
+                off = rnd() % doc;
+            }
+            char c = 'a' + rnd() % 26;
+            j.insert(off, &c, 1);
+            naive.push_back(naiveEdit{ JR_INSERT, off, std::string(1, c) });
+            off++;
+        }
+        report("typing runs", edits, j, naive);
+    }
+
+    // Backspace runs
+    {
+        Journal j(1ull << 40);
+        std::vector<naiveEdit> naive;
+        size_t off = 0;
+        for (size_t k = 0; k < edits; k++) {
+            if (k % 20 == 0) {
+                j.cut();
+                off = rnd() % doc + 20;
+            }
+            char c = 'a' + rnd() % 26;
+            j.erase(--off, &c, 1);
+            naive.push_back(naiveEdit{ JR_ERASE, off, std::string(1, c) });
+        }
+        report("backspace runs", edits, j, naive);
+    }
+
+    // Single keys all over the document, each a step of its own
+    {
+        Journal j(1ull << 40);
+        std::vector<naiveEdit> naive;
+        for (size_t k = 0; k < edits; k++) {
+            j.cut();
+            size_t off = rnd() % doc;
+            char c = 'a' + rnd() % 26;
+            if (k & 1) j.insert(off, &c, 1);
+            else j.erase(off, &c, 1);
+            naive.push_back(naiveEdit{ k & 1 ? JR_INSERT : JR_ERASE, off, std::string(1, c) });
+        }
+        report("scattered keys", edits, j, naive);
+    }
+
+    // Pastes of 10k characters
+    {
+        Journal j(1ull << 40);
+        std::vector<naiveEdit> naive;
+        std::string text(10000, 'p');
+        size_t pastes = edits / 1000 + 1;
+        for (size_t k = 0; k < pastes; k++) {
+            j.cut();
+            size_t off = rnd() % doc;
+            j.insert(off, text.data(), text.size());
+            naive.push_back(naiveEdit{ JR_INSERT, off, text });
+        }
+        report("10k pastes", pastes, j, naive);
+    }
+
+    // One replace-all of a 5 character token with a 9 character one
+    {
+        Journal j(1ull << 40);
+        std::vector<naiveEdit> naive;
+        std::vector<ptEdit> matches;
+        std::string old;
+        size_t off = 0;
+        for (size_t k = 0; k < edits; k++) {
+            off += 5 + rnd() % 200;
+            matches.push_back(ptEdit{ off, 5, 0, 9 });
+            old += "token";
+            naive.push_back(naiveEdit{ JR_ERASE, off, "token" });
+            naive.push_back(naiveEdit{ JR_INSERT, off, "TOKEN_NEW" });
+            off += 5;
+        }
+        j.cut();
+        j.replace(matches, old.data(), "TOKEN_NEW", 9);
+        report("replace-all matches", edits, j, naive);
+    }
+
+    // Bounded: the same typing with the journal held to 1 MB
+    {
+        Journal j(1 << 20);
+        std::vector<naiveEdit> naive;
+        size_t off = 0;
+        for (size_t k = 0; k < edits; k++) {
+            if (k % 40 == 0) {
+                j.cut();
+                off = rnd() % doc;
+            }
+            char c = 'a' + rnd() % 26;
+            j.insert(off, &c, 1);
+            off++;
+        }
+        printf("typing runs, 1 MB limit  %9zu edits  journal %zu bytes held, %zu allocated\n",
+            edits, j.bytes(), j.reserved());
+    }
+    return 0;
+}
@@ -1,6 +1,22 @@
 #include <vector>
 #include <stdlib.h>
 
+// Writes n in decimal to out, which needs room for 21 bytes, and returns
+// the length. Used instead of snprintf on the draw path.
+static inline int formatInt(char *out, long n) {
+    char digits[24];
+    int len = 0;
+    unsigned long u = n < 0 ? 0 - (unsigned long)n : n;
+    do {
+        digits[len++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    int j = 0;
+    if (n < 0) out[j++] = '-';
+    while (len) out[j++] = digits[--len];
+    return j;
+}
+
 class Abuf {
     public:
         std::vector<char> buffer;
@@ -12,6 +28,25 @@ class Abuf {
             buffer.insert(buffer.end(), s, s + len);
         }
 
+        void clear() {
+            buffer.clear();
+        }
+
+        // Appends n in decimal
+        void appendInt(long n) {
+            char digits[24];
+            int len = formatInt(digits, n);
+            append(digits, len);
+        }
+
+        void reserve(size_t n) {
+            buffer.reserve(n);
+        }
+
+        size_t capacity() const {
+            return buffer.capacity();
+        }
+
         size_t size() const {
             return buffer.size();
         }
@@ -0,0 +1,482 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "PieceTable.h"
+
+/*** Undo Journal ***/
+// An append-only log of the edits made to the document, for undo and redo.
+// Records are packed into arena blocks with their numbers as varints, each
+// framed by its size at both ends so the log can be walked either way. A
+// run of typing, of deletes or of backspaces grows the last record in place
+// instead of adding one per key. A replace-all is one record holding the
+// replacement once and, per match, its offset, length and old text.
+//
+// Records between two cuts form a step, which undo and redo take back or
+// make again as a whole. Once the log holds more than its limit, the oldest
+// steps are dropped.
+
+#define JR_BLOCK (64 * 1024)
+
+enum jrKind {
+    JR_INSERT = 1, // off, inserted text
+    JR_ERASE,      // off, erased text
+    JR_ERASE_BACK, // end, erased text last byte first: a run of backspaces
+    JR_REPLACE,    // count, replacement, (gap, length) per match, old texts
+};
+
+#define JR_STEP 0x80 // flag on the first record of a step, followed by its id
+
+// A change undo or redo makes to the document. Replace has the edits of a
+// batch, with their texts in text.
+struct jrChange {
+    int kind; // JR_INSERT, JR_ERASE or JR_REPLACE
+    size_t off;
+    size_t len;
+    const char *text;
+    const std::vector<ptEdit> *edits;
+};
+
+struct jrBlock {
+    char *data;
+    size_t size;
+    size_t cap;
+};
+
+class Journal {
+    private:
+        std::vector<jrBlock> blocks;
+        size_t head = 0;      // first live byte of blocks[0]
+        size_t curBlock = 0;  // records before the cursor are applied,
+        size_t curOff = 0;    // the ones after it can be redone
+        size_t used = 0;      // live bytes
+        size_t limit;
+        unsigned long nextId = 1;
+        unsigned long headId = 0; // the last step dropped
+        bool cutNext = true;  // the next record starts a step
+        bool extendable = false; // the record before the cursor may grow
+        int lastKind = 0;
+        size_t lastOff = 0, lastLen = 0;
+        std::string scratch;
+        std::vector<ptEdit> edits;
+
+        static size_t varintLen(size_t v) {
+            size_t n = 1;
+            while (v >= 0x80) {
+                v >>= 7;
+                n++;
+            }
+            return n;
+        }
+
+        static char *putVarint(char *p, size_t v) {
+            while (v >= 0x80) {
+                *p++ = (char)(v | 0x80);
+                v >>= 7;
+            }
+            *p++ = (char)v;
+            return p;
+        }
+
+        static size_t getVarint(const char *&p) {
+            size_t v = 0;
+            int shift = 0;
+            unsigned char c;
+            do {
+                c = *p++;
+                v |= (size_t)(c & 0x7f) << shift;
+                shift += 7;
+            } while (c & 0x80);
+            return v;
+        }
+
+        // The trailer is a varint stored last byte first, so it reads
+        // backwards from the end of the record
+        static char *putTrailer(char *p, size_t v) {
+            char buf[10];
+            char *e = putVarint(buf, v);
+            while (e > buf) *p++ = *--e;
+            return p;
+        }
+
+        static size_t getTrailer(const char *&end) {
+            size_t v = 0;
+            int shift = 0;
+            unsigned char c;
+            do {
+                c = *--end;
+                v |= (size_t)(c & 0x7f) << shift;
+                shift += 7;
+            } while (c & 0x80);
+            return v;
+        }
+
+        static size_t frameLen(size_t body) {
+            return varintLen(body) + body + varintLen(body);
+        }
+
+        // Drops the records after the cursor
+        void truncate() {
+            if (blocks.empty()) return;
+            while (blocks.size() > curBlock + 1) {
+                used -= blocks.back().size;
+                free(blocks.back().data);
+                blocks.pop_back();
+            }
+            jrBlock &b = blocks[curBlock];
+            used -= b.size - curOff;
+            b.size = curOff;
+            // Keep the cursor at the end of a record
+            while (curBlock > 0 && curOff == 0) {
+                free(blocks.back().data);
+                blocks.pop_back();
+                curBlock--;
+                curOff = blocks[curBlock].size;
+            }
+        }
+
+        // Room for a record of size bytes at the cursor
+        char *reserve(size_t size) {
+            if (blocks.empty() || blocks[curBlock].cap - blocks[curBlock].size < size) {
+                jrBlock b;
+                b.cap = size > JR_BLOCK ? size : JR_BLOCK;
+                b.data = (char *)malloc(b.cap);
+                b.size = 0;
+                blocks.push_back(b);
+                curBlock = blocks.size() - 1;
+                curOff = 0;
+            }
+            return blocks[curBlock].data + curOff;
+        }
+
+        // Writes a record with the given fields and payload at the cursor
+        void record(int kind, size_t field, const char *s, size_t n) {
+            truncate();
+            bool step = cutNext;
+            unsigned long id = step ? nextId++ : 0;
+            size_t body = 1 + (step ? varintLen(id) : 0) + varintLen(field) + n;
+            size_t size = frameLen(body);
+            char *p = reserve(size);
+            p = putVarint(p, body);
+            *p++ = (char)(kind | (step ? JR_STEP : 0));
+            if (step) p = putVarint(p, id);
+            p = putVarint(p, field);
+            if (kind == JR_ERASE_BACK) {
+                for (size_t j = 0; j < n; j++) p[j] = s[n - 1 - j];
+            } else {
+                memcpy(p, s, n);
+            }
+            p = putTrailer(p + n, body);
+            blocks[curBlock].size += size;
+            curOff += size;
+            used += size;
+            cutNext = false;
+            extendable = true;
+            lastKind = kind;
+            lastOff = field;
+            lastLen = n;
+            trim();
+        }
+
+        // Adds s[0, n) to the payload of the record before the cursor, when
+        // the block has room and its size keeps the same width
+        bool extend(const char *s, size_t n) {
+            if (!extendable) return false;
+            jrBlock &b = blocks[curBlock];
+            const char *end = b.data + curOff;
+            size_t body = getTrailer(end);
+            if (varintLen(body + n) != varintLen(body) || b.cap - b.size < n) return false;
+            char *start = b.data + curOff - frameLen(body);
+            char *p = start + varintLen(body) + body;
+            if (lastKind == JR_ERASE_BACK) {
+                for (size_t j = 0; j < n; j++) p[j] = s[n - 1 - j];
+            } else {
+                memcpy(p, s, n);
+            }
+            putVarint(start, body + n);
+            putTrailer(p + n, body + n);
+            size_t grown = frameLen(body + n) - frameLen(body);
+            b.size += grown;
+            curOff += grown;
+            used += grown;
+            lastLen += n;
+            return true;
+        }
+
+        // Turns the one byte erase before the cursor into the start of a run
+        // of backspaces
+        bool relabel() {
+            if (!extendable) return false;
+            jrBlock &b = blocks[curBlock];
+            const char *end = b.data + curOff;
+            size_t body = getTrailer(end);
+            char *p = b.data + curOff - frameLen(body) + varintLen(body);
+            unsigned char flags = *p;
+            const char *field = p + 1;
+            if (flags & JR_STEP) getVarint(field);
+            size_t endOff = lastOff + lastLen;
+            if (varintLen(endOff) != varintLen(lastOff)) return false;
+            *p = (char)(JR_ERASE_BACK | (flags & JR_STEP));
+            putVarint(p + (field - p), endOff);
+            lastKind = JR_ERASE_BACK;
+            lastOff = endOff;
+            return true;
+        }
+
+        // Start of the record ending at the cursor, which must not be at
+        // the head
+        void back(size_t &blk, size_t &off, const char *&body, size_t &len) const {
+            while (off == (blk == 0 ? head : 0)) off = blocks[--blk].size;
+            const char *end = blocks[blk].data + off;
+            len = getTrailer(end);
+            body = end - len;
+            off -= frameLen(len);
+        }
+
+        // The record starting at the cursor, which must not be at the end
+        void forward(size_t &blk, size_t &off, const char *&body, size_t &len) const {
+            while (off == blocks[blk].size) {
+                blk++;
+                off = 0;
+            }
+            const char *p = blocks[blk].data + off;
+            len = getVarint(p);
+            body = p;
+            off += frameLen(len);
+        }
+
+        // Whether no record ends at or before blk, off
+        bool headAt(size_t blk, size_t off) const {
+            for (size_t b = 0; b <= blk && b < blocks.size(); b++) {
+                size_t from = b == 0 ? head : 0;
+                size_t to = b == blk ? off : blocks[b].size;
+                if (to > from) return false;
+            }
+            return true;
+        }
+
+        bool atHead() const { return headAt(curBlock, curOff); }
+
+        bool atEnd() const {
+            if (blocks.empty()) return true;
+            if (curOff < blocks[curBlock].size) return false;
+            for (size_t b = curBlock + 1; b < blocks.size(); b++) {
+                if (blocks[b].size > 0) return false;
+            }
+            return true;
+        }
+
+        // Drops the oldest steps while over the limit. The step the cursor
+        // is in and the ones after it are kept.
+        void trim() {
+            while (used > limit) {
+                size_t blk = 0, off = head, len;
+                const char *body;
+                forward(blk, off, body, len);
+                size_t dropped = frameLen(len);
+                const char *p = body + 1;
+                unsigned long id = getVarint(p);
+                while (!(blk == curBlock && off == curOff)) {
+                    size_t b2 = blk, o2 = off;
+                    forward(b2, o2, body, len);
+                    if ((unsigned char)*body & JR_STEP) break;
+                    blk = b2;
+                    off = o2;
+                    dropped += frameLen(len);
+                }
+                if (blk == curBlock && off == curOff) return;
+                // Free the blocks the dropped records used up
+                while (blk > 0) {
+                    free(blocks[0].data);
+                    blocks.erase(blocks.begin());
+                    blk--;
+                    curBlock--;
+                }
+                if (off == blocks[0].size && blocks.size() > 1) {
+                    free(blocks[0].data);
+                    blocks.erase(blocks.begin());
+                    curBlock--;
+                    off = 0;
+                }
+                head = off;
+                headId = id;
+                used -= dropped;
+            }
+        }
+
+        // Decodes a replace record into edits of the document before it
+        // (redo) or after it (undo), and sets text to what they insert
+        void decodeReplace(const char *p, bool undo, const char *&text) {
+            size_t count = getVarint(p);
+            size_t wlen = getVarint(p);
+            const char *with = p;
+            p += wlen;
+            edits.clear();
+            edits.reserve(count);
+            size_t at = 0, shift = 0, old = 0;
+            for (size_t j = 0; j < count; j++) {
+                at += getVarint(p);
+                size_t len = getVarint(p);
+                if (undo) edits.push_back(ptEdit{ at + shift, wlen, old, len });
+                else edits.push_back(ptEdit{ at, len, 0, wlen });
+                old += len;
+                at += len;
+                shift += wlen - len;
+            }
+            text = undo ? p : with;
+        }
+
+        // Calls fn with the change that applies (or takes back, with undo
+        // set) the record with the given body
+        template <typename F>
+        void change(const char *body, size_t len, bool undo, F &fn) {
+            const char *p = body;
+            unsigned char flags = *p++;
+            int kind = flags & ~JR_STEP;
+            if (flags & JR_STEP) getVarint(p);
+            if (kind == JR_REPLACE) {
+                const char *text;
+                decodeReplace(p, undo, text);
+                fn(jrChange{ JR_REPLACE, 0, 0, text, &edits });
+                return;
+            }
+            size_t field = getVarint(p);
+            size_t n = body + len - p;
+            const char *text = p;
+            if (kind == JR_ERASE_BACK) {
+                scratch.assign(p, n);
+                std::reverse(scratch.begin(), scratch.end());
+                text = scratch.data();
+                field -= n;
+            }
+            bool inserts = (kind == JR_INSERT) != undo;
+            fn(jrChange{ inserts ? JR_INSERT : JR_ERASE, field, n, text, NULL });
+        }
+
+    public:
+        explicit Journal(size_t maxBytes) : limit(maxBytes) {}
+
+        Journal(const Journal&) = delete;
+        Journal& operator=(const Journal&) = delete;
+
+        ~Journal() {
+            clear();
+        }
+
+        void clear() {
+            for (jrBlock &b : blocks) free(b.data);
+            blocks.clear();
+            head = curBlock = curOff = used = 0;
+            headId = 0;
+            cutNext = true;
+            extendable = false;
+        }
+
+        // Bytes of records held, and bytes allocated for them
+        size_t bytes() const { return used; }
+        size_t reserved() const {
+            size_t n = 0;
+            for (const jrBlock &b : blocks) n += b.cap;
+            return n;
+        }
+
+        // The next edit starts a new step
+        void cut() {
+            cutNext = true;
+            extendable = false;
+        }
+
+        // Identifies the document as the cursor leaves it: the id of the
+        // step before the cursor, 0 before the first
+        unsigned long state() const {
+            size_t blk = curBlock, off = curOff, len;
+            const char *body;
+            while (!headAt(blk, off)) {
+                back(blk, off, body, len);
+                const char *p = body;
+                if ((unsigned char)*p++ & JR_STEP) return getVarint(p);
+            }
+            return headId;
+        }
+
+        void insert(size_t off, const char *s, size_t n) {
+            if (n == 0) return;
+            if (!cutNext && lastKind == JR_INSERT && off == lastOff + lastLen && extend(s, n)) return;
+            record(JR_INSERT, off, s, n);
+        }
+
+        // s[0, n) is the text being erased from off
+        void erase(size_t off, const char *s, size_t n) {
+            if (n == 0) return;
+            if (!cutNext) {
+                // Delete keeps erasing at the same offset, backspace erases
+                // what is just before the last erase
+                if (lastKind == JR_ERASE && off == lastOff && extend(s, n)) return;
+                if (lastKind == JR_ERASE && lastLen == 1 && off + n == lastOff) relabel();
+                if (lastKind == JR_ERASE_BACK && off + n == lastOff - lastLen && extend(s, n)) return;
+            }
+            record(JR_ERASE, off, s, n);
+        }
+
+        // Records replacing each of matches, ascending and apart, with
+        // with[0, wlen). Only their off and len are used, and old holds their
+        // texts one after the other.
+        void replace(const std::vector<ptEdit> &matches, const char *old, const char *with, size_t wlen) {
+            size_t count = matches.size();
+            if (count == 0) return;
+            std::string body;
+            char buf[10];
+            body.append(buf, putVarint(buf, count) - buf);
+            body.append(buf, putVarint(buf, wlen) - buf);
+            body.append(with, wlen);
+            size_t at = 0, total = 0;
+            for (const ptEdit &m : matches) {
+                body.append(buf, putVarint(buf, m.off - at) - buf);
+                body.append(buf, putVarint(buf, m.len) - buf);
+                at = m.off + m.len;
+                total += m.len;
+            }
+            body.append(old, total);
+            // The count takes the place of the offset field
+            const char *p = body.data();
+            getVarint(p);
+            record(JR_REPLACE, count, p, body.data() + body.size() - p);
+            extendable = false;
+        }
+
+        // Takes back the step before the cursor, calling fn(change) for
+        // each of its records last first. Returns false when there is none.
+        template <typename F>
+        bool undo(F fn) {
+            if (atHead()) return false;
+            const char *body;
+            size_t len;
+            do {
+                back(curBlock, curOff, body, len);
+                change(body, len, true, fn);
+            } while (!((unsigned char)*body & JR_STEP) && !atHead());
+            cut();
+            return true;
+        }
+
+        // Makes the step after the cursor again. Returns false when there is
+        // none.
+        template <typename F>
+        bool redo(F fn) {
+            if (atEnd()) return false;
+            const char *body;
+            size_t len;
+            do {
+                forward(curBlock, curOff, body, len);
+                change(body, len, false, fn);
+                if (atEnd()) break;
+                size_t b2 = curBlock, o2 = curOff;
+                forward(b2, o2, body, len);
+            } while (!((unsigned char)*body & JR_STEP));
+            cut();
+            return true;
+        }
+};
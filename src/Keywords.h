@@ -0,0 +1,89 @@
+#pragma once
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*** Keyword Table ***/
+// A keyword list compiled into a perfect hash: the table is grown and the
+// hash reseeded until every keyword lands in a slot of its own, so looking a
+// word up costs one hash of the word and one comparison, however many
+// keywords the syntax has. Keywords ending in '|' are of the second kind.
+
+struct kwSlot {
+    const char *word; // NULL for an empty slot
+    size_t len;
+    int kind;         // 1 or 2
+};
+
+class KeywordTable {
+    private:
+        std::vector<kwSlot> slots;
+        uint32_t mask = 0;
+        uint32_t seed = 0;
+        size_t minlen = 0, maxlen = 0;
+
+        static uint32_t hash(const char *s, size_t len, uint32_t seed) {
+            uint32_t h = 2166136261u ^ seed;
+            for (size_t j = 0; j < len; j++) {
+                h ^= (unsigned char)s[j];
+                h *= 16777619u;
+            }
+            return h ^ (h >> 15);
+        }
+
+        bool place(const std::vector<kwSlot> &words, size_t size, uint32_t s) {
+            slots.assign(size, kwSlot{ NULL, 0, 0 });
+            for (const kwSlot &w : words) {
+                kwSlot &slot = slots[hash(w.word, w.len, s) & (size - 1)];
+                if (slot.word) return false;
+                slot = w;
+            }
+            mask = size - 1;
+            seed = s;
+            return true;
+        }
+
+    public:
+        bool built() const { return !slots.empty(); }
+
+        // keywords is a NULL terminated list. A keyword listed twice keeps
+        // its first kind, as the list was matched in order.
+        void build(const char **keywords) {
+            std::vector<kwSlot> words;
+            minlen = (size_t)-1;
+            maxlen = 0;
+            for (size_t j = 0; keywords[j]; j++) {
+                kwSlot w = { keywords[j], strlen(keywords[j]), 1 };
+                if (w.len > 0 && w.word[w.len - 1] == '|') {
+                    w.len--;
+                    w.kind = 2;
+                }
+                bool seen = false;
+                for (const kwSlot &v : words) {
+                    if (v.len == w.len && !memcmp(v.word, w.word, w.len)) seen = true;
+                }
+                if (seen || w.len == 0) continue;
+                words.push_back(w);
+                if (w.len < minlen) minlen = w.len;
+                if (w.len > maxlen) maxlen = w.len;
+            }
+
+            size_t size = 8;
+            while (size < 2 * words.size()) size *= 2;
+            for (;;) {
+                for (uint32_t s = 0; s < 256; s++) {
+                    if (place(words, size, s * 0x9e3779b9u)) return;
+                }
+                size *= 2;
+            }
+        }
+
+        // Kind of keyword s[0, len) is, or 0 when it is not one
+        int lookup(const char *s, size_t len) const {
+            if (len < minlen || len > maxlen) return 0;
+            const kwSlot &slot = slots[hash(s, len, seed) & mask];
+            if (slot.word && slot.len == len && !memcmp(slot.word, s, len)) return slot.kind;
+            return 0;
+        }
+};
@@ -0,0 +1,128 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include "Simd.h"
+#include "Trace.h"
+
+/*** Line Indexer ***/
+// Finds the newlines of a file buffer in the background so the editor can
+// show the start of a large file while the rest is still being indexed. The
+// buffer is cut into chunks that a pool of threads scans with the SIMD
+// kernel. Finished chunks are published strictly in file order, so the
+// offsets handed out by take() are always sorted and gap free.
+
+#define LI_CHUNK (4 * 1024 * 1024)
+
+struct liChunk {
+    std::vector<size_t> nl;
+    size_t crlf;
+    bool ready;
+};
+
+class LineIndexer {
+    private:
+        const char *data = nullptr;
+        size_t size = 0;
+        std::vector<std::thread> workers;
+        std::vector<liChunk> chunks;
+        std::atomic<size_t> next{0};  // next chunk to hand to a worker
+        std::atomic<bool> cancel{false};
+
+        std::mutex lock;
+        std::condition_variable progress;
+        size_t published = 0;        // chunks moved to pending so far
+        std::vector<size_t> pending; // newline offsets not taken yet
+        size_t pendingCrlf = 0;
+        size_t scanned = 0;          // bytes published so far
+        size_t taken = 0;            // value of scanned at the last take
+
+        void work() {
+            traceThread("indexer");
+            std::vector<size_t> nl;
+            for (;;) {
+                size_t k = next.fetch_add(1);
+                if (k >= chunks.size() || cancel) return;
+                size_t from = k * LI_CHUNK;
+                size_t to = size - from > LI_CHUNK ? from + LI_CHUNK : size;
+                nl.clear();
+                size_t crlf;
+                {
+                    TRACE_SCOPE("simdFindNewlines");
+                    crlf = simdFindNewlines(data, from, to, nl);
+                }
+
+                std::lock_guard<std::mutex> guard(lock);
+                chunks[k].nl.swap(nl);
+                chunks[k].crlf = crlf;
+                chunks[k].ready = true;
+                size_t before = published;
+                while (published < chunks.size() && chunks[published].ready) {
+                    liChunk &c = chunks[published];
+                    pending.insert(pending.end(), c.nl.begin(), c.nl.end());
+                    std::vector<size_t>().swap(c.nl);
+                    pendingCrlf += c.crlf;
+                    published++;
+                    scanned = published * LI_CHUNK < size ? published * LI_CHUNK : size;
+                }
+                if (published != before) progress.notify_all();
+            }
+        }
+
+        void join() {
+            for (std::thread &t : workers) t.join();
+            workers.clear();
+        }
+
+    public:
+        LineIndexer() = default;
+        LineIndexer(const LineIndexer&) = delete;
+        LineIndexer& operator=(const LineIndexer&) = delete;
+
+        ~LineIndexer() {
+            stop();
+        }
+
+        void start(const char *d, size_t n) {
+            stop();
+            data = d;
+            size = n;
+            chunks.assign((n + LI_CHUNK - 1) / LI_CHUNK, liChunk{ {}, 0, false });
+            next = 0;
+            cancel = false;
+            published = scanned = taken = pendingCrlf = 0;
+            pending.clear();
+
+            size_t threads = std::thread::hardware_concurrency();
+            if (threads == 0) threads = 1;
+            if (threads > chunks.size()) threads = chunks.size();
+            for (size_t j = 0; j < threads; j++) workers.emplace_back(&LineIndexer::work, this);
+        }
+
+        void stop() {
+            cancel = true;
+            join();
+        }
+
+        // Moves the newline offsets published since the last call onto nl,
+        // adds how many of them end a CRLF pair to crlf and returns how many
+        // bytes have been indexed. With wait set, blocks until there is
+        // progress.
+        size_t take(std::vector<size_t> &nl, size_t &crlf, bool wait) {
+            std::unique_lock<std::mutex> guard(lock);
+            if (wait) progress.wait(guard, [&] { return scanned > taken || scanned == size; });
+            if (nl.empty()) nl.swap(pending);
+            else nl.insert(nl.end(), pending.begin(), pending.end());
+            pending.clear();
+            crlf += pendingCrlf;
+            pendingCrlf = 0;
+            taken = scanned;
+            if (scanned == size && !workers.empty()) {
+                guard.unlock();
+                join();
+            }
+            return taken;
+        }
+};
@@ -0,0 +1,452 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include "Simd.h"
+
+/*** Piece Table ***/
+// The document is a sequence of pieces. Each piece is a span of either the
+// original file buffer (buffer 0, never modified) or of an append-only add
+// block. Pieces live in a treap ordered by position, and every node caches
+// the byte length and newline count of its subtree, so finding the start of
+// line n or splicing text in is O(log pieces) whatever the file size.
+
+#define PT_ADD_BLOCK (64 * 1024)
+
+struct ptBuffer {
+    char *data;
+    size_t size;
+    size_t cap;
+    std::vector<size_t> nl; // offsets of every '\n' in data, ascending
+};
+
+struct ptPiece {
+    unsigned int buf;
+    size_t start;
+    size_t len;
+    size_t lf;
+};
+
+// Replaces the document bytes [off, off + len) with text[start, start + n)
+// of a batch's text, see PieceTable::replace
+struct ptEdit {
+    size_t off;
+    size_t len;
+    size_t start;
+    size_t n;
+};
+
+struct ptNode {
+    ptPiece p;
+    unsigned int prio;
+    ptNode *left, *right;
+    size_t len; // bytes in this subtree
+    size_t lf;  // newlines in this subtree
+};
+
+class PieceTable {
+    private:
+        std::vector<ptBuffer> buffers;
+        ptNode *root = nullptr;
+        size_t attached = 0; // bytes of the original buffer in the document
+        unsigned int seed = 2463534242u;
+
+        static size_t lenOf(ptNode *t) { return t ? t -> len : 0; }
+        static size_t lfOf(ptNode *t) { return t ? t -> lf : 0; }
+
+        static void update(ptNode *t) {
+            t -> len = lenOf(t -> left) + t -> p.len + lenOf(t -> right);
+            t -> lf = lfOf(t -> left) + t -> p.lf + lfOf(t -> right);
+        }
+
+        unsigned int random() {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            return seed;
+        }
+
+        ptNode *newNode(ptPiece p) {
+            ptNode *t = (ptNode *)malloc(sizeof(ptNode));
+            t -> p = p;
+            t -> prio = random();
+            t -> left = t -> right = nullptr;
+            update(t);
+            return t;
+        }
+
+        static void collect(ptNode *t, std::vector<ptPiece> &out) {
+            if (!t) return;
+            collect(t -> left, out);
+            out.push_back(t -> p);
+            collect(t -> right, out);
+        }
+
+        static void updateTree(ptNode *t) {
+            if (!t) return;
+            updateTree(t -> left);
+            updateTree(t -> right);
+            update(t);
+        }
+
+        // Builds a treap holding pieces in order, in linear time: each node
+        // goes down the right spine to below the first one it outranks
+        ptNode *build(const std::vector<ptPiece> &pieces) {
+            std::vector<ptNode *> spine;
+            for (const ptPiece &p : pieces) {
+                ptNode *t = newNode(p);
+                ptNode *last = nullptr;
+                while (!spine.empty() && spine.back() -> prio < t -> prio) {
+                    last = spine.back();
+                    spine.pop_back();
+                }
+                t -> left = last;
+                if (!spine.empty()) spine.back() -> right = t;
+                spine.push_back(t);
+            }
+            if (spine.empty()) return nullptr;
+            updateTree(spine[0]);
+            return spine[0];
+        }
+
+        // Adds the part [from, from + len) of piece p to out, joining it to
+        // the last piece when it continues it
+        void emit(std::vector<ptPiece> &out, const ptPiece &p, size_t from, size_t len) {
+            if (len == 0) return;
+            ptPiece q = { p.buf, p.start + from, len, 0 };
+            q.lf = (from == 0 && len == p.len) ? p.lf : countNewlines(q.buf, q.start, len);
+            if (!out.empty() && out.back().buf == q.buf && out.back().start + out.back().len == q.start) {
+                out.back().len += q.len;
+                out.back().lf += q.lf;
+            } else {
+                out.push_back(q);
+            }
+        }
+
+        static void freeTree(ptNode *t) {
+            if (!t) return;
+            freeTree(t -> left);
+            freeTree(t -> right);
+            free(t);
+        }
+
+        // Index of the first newline in buffer b at or after offset off
+        size_t firstNewline(unsigned int b, size_t off) const {
+            const std::vector<size_t> &nl = buffers[b].nl;
+            return std::lower_bound(nl.begin(), nl.end(), off) - nl.begin();
+        }
+
+        size_t countNewlines(unsigned int b, size_t start, size_t len) const {
+            return firstNewline(b, start + len) - firstNewline(b, start);
+        }
+
+        static ptNode *merge(ptNode *l, ptNode *r) {
+            if (!l) return r;
+            if (!r) return l;
+            if (l -> prio > r -> prio) {
+                l -> right = merge(l -> right, r);
+                update(l);
+                return l;
+            }
+            r -> left = merge(l, r -> left);
+            update(r);
+            return r;
+        }
+
+        // Splits t so that l holds the first off bytes and r the rest,
+        // cutting a piece in two when off falls inside it.
+        void split(ptNode *t, size_t off, ptNode *&l, ptNode *&r) {
+            if (!t) {
+                l = r = nullptr;
+                return;
+            }
+            size_t ll = lenOf(t -> left);
+            if (off <= ll) {
+                split(t -> left, off, l, t -> left);
+                update(t);
+                r = t;
+            } else if (off >= ll + t -> p.len) {
+                split(t -> right, off - ll - t -> p.len, t -> right, r);
+                update(t);
+                l = t;
+            } else {
+                size_t k = off - ll;
+                ptPiece tail = t -> p;
+                tail.start += k;
+                tail.len -= k;
+                tail.lf = countNewlines(tail.buf, tail.start, tail.len);
+                t -> p.len = k;
+                t -> p.lf -= tail.lf;
+
+                ptNode *rest = t -> right;
+                t -> right = nullptr;
+                update(t);
+                l = t;
+                r = merge(newNode(tail), rest);
+            }
+        }
+
+        template <typename F>
+        void visit(ptNode *t, size_t a, size_t b, F &fn) const {
+            if (!t || a >= b) return;
+            size_t ll = lenOf(t -> left);
+            size_t pe = ll + t -> p.len;
+            if (a < ll) visit(t -> left, a, b < ll ? b : ll, fn);
+            size_t s = a > ll ? a : ll;
+            size_t e = b < pe ? b : pe;
+            if (s < e) fn(t -> p, s - ll, e - s);
+            if (b > pe) visit(t -> right, a > pe ? a - pe : 0, b - pe, fn);
+        }
+
+        template <typename F>
+        void visitReverse(ptNode *t, size_t a, size_t b, F &fn) const {
+            if (!t || a >= b) return;
+            size_t ll = lenOf(t -> left);
+            size_t pe = ll + t -> p.len;
+            if (b > pe) visitReverse(t -> right, a > pe ? a - pe : 0, b - pe, fn);
+            size_t s = a > ll ? a : ll;
+            size_t e = b < pe ? b : pe;
+            if (s < e) fn(t -> p, s - ll, e - s);
+            if (a < ll) visitReverse(t -> left, a, b < ll ? b : ll, fn);
+        }
+
+        ptPiece append(const char *s, size_t len) {
+            if (buffers.size() < 2 || buffers.back().cap - buffers.back().size < len) {
+                ptBuffer blk;
+                blk.cap = len > PT_ADD_BLOCK ? len : PT_ADD_BLOCK;
+                blk.data = (char *)malloc(blk.cap);
+                blk.size = 0;
+                buffers.push_back(blk);
+            }
+            unsigned int b = buffers.size() - 1;
+            ptBuffer &blk = buffers[b];
+            ptPiece p = { b, blk.size, len, 0 };
+            memcpy(blk.data + blk.size, s, len);
+            size_t before = blk.nl.size();
+            simdFindNewlines(blk.data, blk.size, blk.size + len, blk.nl);
+            p.lf = blk.nl.size() - before;
+            blk.size += len;
+            return p;
+        }
+
+        // Inserts p at off, growing the piece before it when p continues it
+        void insertPiece(size_t off, ptPiece p) {
+            ptNode *l, *r;
+            split(root, off, l, r);
+            ptNode *last = l;
+            while (last && last -> right) last = last -> right;
+            if (last && last -> p.buf == p.buf && last -> p.start + last -> p.len == p.start) {
+                for (ptNode *t = l; t; t = t -> right) {
+                    t -> len += p.len;
+                    t -> lf += p.lf;
+                }
+                last -> p.len += p.len;
+                last -> p.lf += p.lf;
+            } else {
+                l = merge(l, newNode(p));
+            }
+            root = merge(l, r);
+        }
+
+    public:
+        PieceTable() {
+            buffers.push_back(ptBuffer{ nullptr, 0, 0, {} });
+        }
+
+        PieceTable(const PieceTable&) = delete;
+        PieceTable& operator=(const PieceTable&) = delete;
+
+        ~PieceTable() {
+            clear();
+        }
+
+        // Drops all text and add blocks. The original buffer is not owned.
+        void clear() {
+            freeTree(root);
+            root = nullptr;
+            for (size_t b = 1; b < buffers.size(); b++) free(buffers[b].data);
+            buffers.resize(1);
+            buffers[0] = ptBuffer{ nullptr, 0, 0, {} };
+            attached = 0;
+        }
+
+        // Starts an empty document over data, which must outlive the table.
+        // The file text is attached later with appendOriginal as it gets
+        // indexed.
+        void openDeferred(const char *data, size_t size) {
+            clear();
+            buffers[0].data = (char *)data;
+            buffers[0].size = buffers[0].cap = size;
+        }
+
+        // Starts a document holding all of data, indexing it immediately.
+        void open(const char *data, size_t size) {
+            openDeferred(data, size);
+            std::vector<size_t> nl;
+            simdFindNewlines(data, 0, size, nl);
+            appendOriginal(nl.data(), nl.size(), size);
+        }
+
+        // Appends the original bytes [attached(), end) to the end of the
+        // document. nl holds the offsets of the newlines in that range.
+        void appendOriginal(const size_t *nl, size_t count, size_t end) {
+            if (end <= attached) return;
+            buffers[0].nl.insert(buffers[0].nl.end(), nl, nl + count);
+            insertPiece(length(), ptPiece{ 0, attached, end - attached, count });
+            attached = end;
+        }
+
+        size_t attachedOriginal() const { return attached; }
+
+        size_t length() const { return lenOf(root); }
+        size_t lineCount() const { return lfOf(root); }
+
+        // Byte offset of the first character of line n (0 based). Lines past
+        // the last newline start at length().
+        size_t lineStart(size_t line) const {
+            if (line == 0) return 0;
+            size_t j = line - 1, base = 0;
+            ptNode *t = root;
+            while (t) {
+                size_t llf = lfOf(t -> left);
+                if (j < llf) {
+                    t = t -> left;
+                    continue;
+                }
+                j -= llf;
+                base += lenOf(t -> left);
+                if (j < t -> p.lf) {
+                    size_t nl = buffers[t -> p.buf].nl[firstNewline(t -> p.buf, t -> p.start) + j];
+                    return base + (nl - t -> p.start) + 1;
+                }
+                j -= t -> p.lf;
+                base += t -> p.len;
+                t = t -> right;
+            }
+            return length();
+        }
+
+        // Line number containing byte offset off
+        size_t lineOf(size_t off) const {
+            size_t line = 0;
+            ptNode *t = root;
+            while (t) {
+                size_t ll = lenOf(t -> left);
+                if (off < ll) {
+                    t = t -> left;
+                    continue;
+                }
+                line += lfOf(t -> left);
+                off -= ll;
+                if (off < t -> p.len) return line + countNewlines(t -> p.buf, t -> p.start, off);
+                line += t -> p.lf;
+                off -= t -> p.len;
+                t = t -> right;
+            }
+            return line;
+        }
+
+        void insert(size_t off, const char *s, size_t len) {
+            if (len == 0) return;
+            if (off > length()) off = length();
+            // Typing appends to the add block right after the previous
+            // character, so it extends that piece instead of adding a node
+            insertPiece(off, append(s, len));
+        }
+
+        void erase(size_t off, size_t len) {
+            if (len == 0 || off >= length()) return;
+            ptNode *l, *m, *r;
+            split(root, off, l, m);
+            split(m, len, m, r);
+            freeTree(m);
+            root = merge(l, r);
+        }
+
+        // Makes all of edits at once. They must be ascending and must not
+        // overlap, and each replacement is a range of text. The text is
+        // appended once and the tree is rebuilt from the new pieces, which
+        // is linear in the pieces where one insert and erase per edit would
+        // split and merge the tree for each.
+        void replace(const std::vector<ptEdit> &edits, const std::string &text) {
+            if (edits.empty()) return;
+            ptPiece added = text.empty() ? ptPiece{ 0, 0, 0, 0 } : append(text.data(), text.size());
+            std::vector<ptPiece> old, pieces;
+            collect(root, old);
+            pieces.reserve(old.size() + 2 * edits.size());
+            size_t j = 0, base = 0; // old[j] starts at base
+            size_t pos = 0;         // bytes of the document emitted
+            auto copyTo = [&](size_t to) {
+                while (pos < to) {
+                    while (base + old[j].len <= pos) base += old[j++].len;
+                    size_t in = pos - base;
+                    size_t n = old[j].len - in < to - pos ? old[j].len - in : to - pos;
+                    emit(pieces, old[j], in, n);
+                    pos += n;
+                }
+            };
+            for (const ptEdit &e : edits) {
+                copyTo(e.off);
+                emit(pieces, added, e.start, e.n);
+                pos = e.off + e.len;
+            }
+            copyTo(length());
+            freeTree(root);
+            root = build(pieces);
+        }
+
+        // Calls fn(const char *s, size_t n) for each contiguous span of the
+        // range [off, off + len), in order.
+        template <typename F>
+        void forEachSpan(size_t off, size_t len, F fn) const {
+            auto span = [&](const ptPiece &p, size_t from, size_t n) {
+                fn(buffers[p.buf].data + p.start + from, n);
+            };
+            visit(root, off, off + len, span);
+        }
+
+        // Same as forEachSpan, last span first
+        template <typename F>
+        void forEachSpanReverse(size_t off, size_t len, F fn) const {
+            auto span = [&](const ptPiece &p, size_t from, size_t n) {
+                fn(buffers[p.buf].data + p.start + from, n);
+            };
+            visitReverse(root, off, off + len, span);
+        }
+
+        // Calls fn(const char *s, size_t len) with the text of each line in
+        // [from, to), without its newline. Lines that straddle two pieces
+        // are gathered into a scratch buffer, the rest are passed in place.
+        template <typename F>
+        void forEachLine(size_t from, size_t to, F fn) const {
+            size_t start = lineStart(from);
+            std::string carry;
+            forEachSpan(start, lineStart(to) - start, [&](const char *s, size_t n) {
+                const char *p = s, *end = s + n;
+                while (p < end) {
+                    const char *nl = (const char *)memchr(p, '\n', end - p);
+                    if (nl == NULL) {
+                        carry.append(p, end - p);
+                        break;
+                    }
+                    if (carry.empty()) {
+                        fn(p, (size_t)(nl - p));
+                    } else {
+                        carry.append(p, nl - p);
+                        fn(carry.data(), carry.size());
+                        carry.clear();
+                    }
+                    p = nl + 1;
+                }
+            });
+        }
+
+        void copy(size_t off, size_t len, char *out) const {
+            forEachSpan(off, len, [&](const char *s, size_t n) {
+                memcpy(out, s, n);
+                out += n;
+            });
+        }
+};
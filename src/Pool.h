@@ -0,0 +1,135 @@
+#pragma once
+#include <vector>
+#include <stddef.h>
+#include <stdlib.h>
+
+/*** Pool ***/
+// Size-class allocator for row storage. Requests are rounded up to one of
+// four classes between each power of two and the next, so at most a fifth
+// of a block is wasted, and carved from POOL_SLAB sized slabs. A freed block
+// goes on the free list of its class and is handed out again as is, so rows
+// that come and go as the view scrolls stop reaching malloc once the pool is
+// warm. Blocks over POOL_MAX bytes come from malloc. Slabs are not given
+// back one by one, only all at once by trim() when no block is out, which
+// is when the row cache is emptied. Not thread safe.
+
+#define POOL_MIN_SHIFT 5            // 32 byte blocks at the least
+#define POOL_MAX_SHIFT 16           // 64 KB blocks at the most
+#define POOL_MAX (1 << POOL_MAX_SHIFT)
+#define POOL_CLASSES ((POOL_MAX_SHIFT - POOL_MIN_SHIFT) * 4 + 1)
+#define POOL_SLAB (256 * 1024)
+
+struct poolStats {
+    size_t used;     // bytes in blocks handed out
+    size_t reserved; // bytes in slabs, handed out or not
+    size_t large;    // bytes in blocks that came from malloc
+    size_t blocks;   // blocks handed out
+};
+
+class Pool {
+    private:
+        struct poolFree {
+            poolFree *next;
+        };
+
+        poolFree *freeLists[POOL_CLASSES] = {};
+        std::vector<char *> slabs;
+        char *bump = nullptr;     // free space at the end of the newest slab
+        char *bumpEnd = nullptr;
+        poolStats st = {};
+
+        // 2^k < n <= 2^(k+1) falls in class step of 2^k + step * 2^(k-2)
+        static int classOf(size_t n) {
+            if (n <= ((size_t)1 << POOL_MIN_SHIFT)) return 0;
+            int k = 63 - __builtin_clzll(n - 1);
+            size_t quarter = (size_t)1 << (k - 2);
+            int step = (n - ((size_t)1 << k) + quarter - 1) / quarter;
+            return (k - POOL_MIN_SHIFT) * 4 + step;
+        }
+
+        static size_t classSize(int c) {
+            if (c == 0) return (size_t)1 << POOL_MIN_SHIFT;
+            int k = (c - 1) / 4 + POOL_MIN_SHIFT;
+            return ((size_t)1 << k) + ((c - 1) % 4 + 1) * ((size_t)1 << (k - 2));
+        }
+
+    public:
+        Pool() = default;
+        Pool(const Pool&) = delete;
+        Pool& operator=(const Pool&) = delete;
+
+        ~Pool() {
+            for (char *s : slabs) free(s);
+        }
+
+        // What a request of n bytes is rounded up to
+        static size_t capacity(size_t n) {
+            if (n > POOL_MAX) return n;
+            return classSize(classOf(n));
+        }
+
+        // A block of capacity(n) bytes
+        void *alloc(size_t n) {
+            if (n > POOL_MAX) {
+                st.large += n;
+                st.blocks++;
+                return malloc(n);
+            }
+            int c = classOf(n);
+            size_t size = classSize(c);
+            st.used += size;
+            st.blocks++;
+            if (freeLists[c]) {
+                poolFree *b = freeLists[c];
+                freeLists[c] = b -> next;
+                return b;
+            }
+            if ((size_t)(bumpEnd - bump) < size) {
+                // What is left of the old slab goes to the free lists
+                for (int k = c - 1; k >= 0; k--) {
+                    size_t s = classSize(k);
+                    while ((size_t)(bumpEnd - bump) >= s) {
+                        poolFree *b = (poolFree *)bump;
+                        b -> next = freeLists[k];
+                        freeLists[k] = b;
+                        bump += s;
+                    }
+                }
+                bump = (char *)malloc(POOL_SLAB);
+                bumpEnd = bump + POOL_SLAB;
+                slabs.push_back(bump);
+                st.reserved += POOL_SLAB;
+            }
+            void *p = bump;
+            bump += size;
+            return p;
+        }
+
+        // Gives back a block from alloc(n), with the same n
+        void release(void *p, size_t n) {
+            if (!p) return;
+            st.blocks--;
+            if (n > POOL_MAX) {
+                st.large -= n;
+                free(p);
+                return;
+            }
+            int c = classOf(n);
+            st.used -= classSize(c);
+            poolFree *b = (poolFree *)p;
+            b -> next = freeLists[c];
+            freeLists[c] = b;
+        }
+
+        // Frees the slabs if none of their blocks are handed out
+        void trim() {
+            if (st.used != 0) return;
+            for (char *s : slabs) free(s);
+            slabs.clear();
+            for (poolFree *&f : freeLists) f = nullptr;
+            bump = bumpEnd = nullptr;
+            st.reserved = 0;
+        }
+
+        const poolStats &stats() const { return st; }
+};
@@ -0,0 +1,900 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include "Search.h"
+
+/*** Regular Expressions ***/
+// Patterns are parsed into a syntax tree and built into two Thompson NFAs,
+// one of them reversed. The NFAs are run as DFAs whose states are made the
+// first time the text reaches them and cached, so matching costs one table
+// lookup per byte and never backtracks. Matches never span lines: '.' and
+// negated classes leave out '\n', and ^ and $ hold at the ends of the line.
+//
+// A line is first checked with the forward DFA. Where it has a match, one
+// backward pass marks every position a match starts at, and the leftmost
+// longest match from each is found going forward. The forward scans share
+// what they learn about the line (see longestFrom), so listing the matches
+// of a line takes time linear in its length. A substring every match must
+// contain is searched for with SearchPattern first, so only lines that hold
+// it are run through the DFA at all.
+//
+// Supported: literals, ., [...] with ranges and negation, \d \w \s and their
+// negations, \t \n \r \f \v \xHH, ^ $, groups, |, * + ? and {m,n}.
+// Patterns that match empty text are refused.
+
+#define RE_MAX_NODES 20000  // NFA size limit, reached by large counted repeats
+#define RE_MAX_REPEAT 1000  // largest count in {m,n}
+#define RE_MAX_STATES 2048  // DFA states cached before the cache starts over
+#define RE_CANCEL_STRIDE 65536 // bytes scanned between checks for a cancel
+#define RE_MEMO_AFTER 64      // scan length that makes lineMatches use the memo
+#define RE_MEMO_STRIDE 32     // bytes between the positions the memo keeps
+
+struct reSet {
+    uint64_t bits[4];
+};
+
+static inline bool reSetHas(const reSet &s, unsigned char c) {
+    return (s.bits[c >> 6] >> (c & 63)) & 1;
+}
+
+static inline void reSetAdd(reSet &s, unsigned char c) {
+    s.bits[c >> 6] |= (uint64_t)1 << (c & 63);
+}
+
+enum reOp { RE_CHAR, RE_SPLIT, RE_BOL, RE_EOL, RE_MATCH };
+
+struct reNode {
+    int op;
+    int set;  // RE_CHAR: index into the sets
+    int out;
+    int out1; // RE_SPLIT: the second way out
+};
+
+enum reAstOp { RA_SET, RA_CAT, RA_ALT, RA_REP, RA_BOL, RA_EOL, RA_EMPTY };
+
+struct reAst {
+    int op;
+    int set;
+    int min, max; // RA_REP, max is -1 when unbounded
+    std::vector<int> kids;
+};
+
+// A DFA over one of the NFAs. With unanchored set a match may start at any
+// position, as if the pattern began with .*
+class reDfa {
+    private:
+        struct State {
+            std::vector<int> nfa; // NFA nodes in the state, sorted
+            int next[256];        // -1 until first taken
+            bool match;           // a match ends here
+            bool matchEnd;        // a match ends here if this is the line end
+        };
+
+        const std::vector<reNode> *nodes = nullptr;
+        const std::vector<reSet> *sets = nullptr;
+        int entry = 0;
+        bool unanchored = false;
+        std::vector<State> states;
+        std::unordered_map<std::string, int> ids;
+        int starts[2] = { -1, -1 }; // away from and at the line start
+        size_t flushes = 0;         // times the cache started over
+        std::vector<int> stack;
+        std::vector<unsigned> mark;
+        unsigned epoch = 0;
+
+        // Adds the nodes reachable from n without reading a byte. EOL nodes
+        // are kept in the set unless eol holds, so matchEnd can follow them.
+        void close(std::vector<int> &out, int n, bool bol, bool eol) {
+            stack.push_back(n);
+            while (!stack.empty()) {
+                n = stack.back();
+                stack.pop_back();
+                if (mark[n] == epoch) continue;
+                mark[n] = epoch;
+                const reNode &node = (*nodes)[n];
+                switch (node.op) {
+                    case RE_SPLIT:
+                        stack.push_back(node.out1);
+                        stack.push_back(node.out);
+                        break;
+                    case RE_BOL:
+                        if (bol) stack.push_back(node.out);
+                        break;
+                    case RE_EOL:
+                        if (eol) stack.push_back(node.out);
+                        else out.push_back(n);
+                        break;
+                    default:
+                        out.push_back(n);
+                }
+            }
+        }
+
+        int intern(std::vector<int> &set, bool bol) {
+            std::sort(set.begin(), set.end());
+            std::string key((const char *)set.data(), set.size() * sizeof(int));
+            key.push_back(bol);
+            auto found = ids.find(key);
+            if (found != ids.end()) return found -> second;
+            if (states.size() >= RE_MAX_STATES) {
+                states.clear();
+                ids.clear();
+                starts[0] = starts[1] = -1;
+                flushes++;
+            }
+
+            State st;
+            st.nfa = set;
+            memset(st.next, -1, sizeof(st.next));
+            st.match = st.matchEnd = false;
+            std::vector<int> end;
+            epoch++;
+            for (int n : set) {
+                const reNode &node = (*nodes)[n];
+                if (node.op == RE_MATCH) st.match = true;
+                if (node.op == RE_EOL) close(end, node.out, bol, true);
+            }
+            for (int n : end) if ((*nodes)[n].op == RE_MATCH) st.matchEnd = true;
+            st.matchEnd = st.matchEnd || st.match;
+
+            states.push_back(std::move(st));
+            ids.emplace(key, states.size() - 1);
+            return states.size() - 1;
+        }
+
+    public:
+        void init(const std::vector<reNode> *n, const std::vector<reSet> *s, int e, bool u) {
+            nodes = n;
+            sets = s;
+            entry = e;
+            unanchored = u;
+            states.clear();
+            ids.clear();
+            starts[0] = starts[1] = -1;
+            mark.assign(n -> size(), 0);
+            epoch = 0;
+        }
+
+        int start(bool bol) {
+            if (starts[bol] != -1) return starts[bol];
+            std::vector<int> set;
+            epoch++;
+            close(set, entry, bol, false);
+            int s = intern(set, bol);
+            starts[bol] = s;
+            return s;
+        }
+
+        int step(int s, unsigned char c) {
+            int t = states[s].next[c];
+            if (t != -1) return t;
+            std::vector<int> set;
+            epoch++;
+            for (int n : states[s].nfa) {
+                const reNode &node = (*nodes)[n];
+                if (node.op == RE_CHAR && reSetHas((*sets)[node.set], c)) close(set, node.out, false, false);
+            }
+            if (unanchored) close(set, entry, false, false);
+            size_t before = flushes;
+            t = intern(set, false);
+            // A full cache starts over, and s is gone with it
+            if (flushes == before) states[s].next[c] = t;
+            return t;
+        }
+
+        // Changes whenever the cache starts over, and state ids with it
+        size_t generation() const { return flushes; }
+
+        bool dead(int s) const { return states[s].nfa.empty(); }
+        bool match(int s) const { return states[s].match; }
+        bool matchEnd(int s) const { return states[s].matchEnd; }
+};
+
+class Regex {
+    private:
+        std::vector<reSet> sets;
+        std::vector<reAst> ast;
+        int root = -1;
+        std::vector<reNode> fwd, rev;
+        int fwdEntry = 0, revEntry = 0;
+        reDfa anchored; // forward, from a given position
+        reDfa search;   // forward, a match may start anywhere
+        reDfa reverse;  // backward from the line end, a match may end anywhere
+        bool icase = false;
+        std::string lit;
+        SearchPattern litpat;
+        std::vector<char> begins; // scratch for lineMatches
+
+        // What the scans of longestFrom have seen of the current line: at
+        // every RE_MEMO_STRIDE-th position, the anchored states reached
+        // there and the furthest match end ahead of each
+        struct reMemo {
+            int state;
+            int next;   // next entry at the same position, or -1
+            size_t far; // 0 when no match ends ahead
+        };
+        std::vector<int> memoHead; // per kept position, first entry or -1
+        std::vector<reMemo> memo;
+        size_t memoGen = 0;        // anchored.generation() the ids are from
+        // A kept position the scan under way passed, with its state there
+        // and the last match end before the next one
+        struct reStep {
+            int state;
+            size_t pos;
+            size_t last;
+        };
+        std::vector<reStep> path;
+
+        // Set by cancelWhen, checked every RE_CANCEL_STRIDE bytes
+        const std::atomic<unsigned> *cancelGen = nullptr;
+        unsigned cancelWant = 0;
+        size_t ticks = 0;
+        bool cancelled = false;
+
+        // Parser state
+        const char *p = nullptr, *end = nullptr;
+        std::string err;
+
+        int newSet() {
+            sets.push_back(reSet{ { 0, 0, 0, 0 } });
+            return sets.size() - 1;
+        }
+
+        int newAst(int op, int set = -1, int min = 0, int max = 0) {
+            ast.push_back(reAst{ op, set, min, max, {} });
+            return ast.size() - 1;
+        }
+
+        void fold(reSet &s) const {
+            if (!icase) return;
+            for (int c = 'a'; c <= 'z'; c++) {
+                if (reSetHas(s, c) || reSetHas(s, c - 32)) {
+                    reSetAdd(s, c);
+                    reSetAdd(s, c - 32);
+                }
+            }
+        }
+
+        // Adds the class of \d, \w or \s (lower case) to s, or its complement
+        static void addClass(reSet &s, char c) {
+            char k = c | 0x20;
+            for (int b = 0; b < 256; b++) {
+                bool in;
+                if (k == 'd') in = b >= '0' && b <= '9';
+                else if (k == 'w') in = (b >= '0' && b <= '9') || (b >= 'a' && b <= 'z') || (b >= 'A' && b <= 'Z') || b == '_';
+                else in = b == ' ' || (b >= '\t' && b <= '\r');
+                if (c != k) in = !in && b != '\n';
+                if (in) reSetAdd(s, b);
+            }
+        }
+
+        // The byte of a one byte escape, or -1
+        int escapedByte() {
+            char c = *p++;
+            switch (c) {
+                case 't': return '\t';
+                case 'n': return '\n';
+                case 'r': return '\r';
+                case 'f': return '\f';
+                case 'v': return '\v';
+                case 'x': {
+                    int v = 0;
+                    for (int k = 0; k < 2; k++) {
+                        if (p == end || !isxdigit((unsigned char)*p)) {
+                            err = "bad \\x escape";
+                            return -1;
+                        }
+                        char h = *p++;
+                        v = v * 16 + (h <= '9' ? h - '0' : (h | 0x20) - 'a' + 10);
+                    }
+                    return v;
+                }
+                case 'b': case 'B':
+                    err = "word boundaries are not supported";
+                    return -1;
+            }
+            if (c >= '1' && c <= '9') {
+                err = "back references are not supported";
+                return -1;
+            }
+            return (unsigned char)c;
+        }
+
+        int parseClass() {
+            int set = newSet();
+            bool negate = (p < end && *p == '^');
+            if (negate) p++;
+            bool first = true;
+            while (p < end && (*p != ']' || first)) {
+                first = false;
+                int lo;
+                if (*p == '\\' && p + 1 < end) {
+                    p++;
+                    if (strchr("dDwWsS", *p)) {
+                        addClass(sets[set], *p++);
+                        continue;
+                    }
+                    lo = escapedByte();
+                    if (lo == -1) return -1;
+                } else {
+                    lo = (unsigned char)*p++;
+                }
+                int hi = lo;
+                if (p + 1 < end && *p == '-' && p[1] != ']') {
+                    p++;
+                    if (*p == '\\' && p + 1 < end) {
+                        p++;
+                        hi = escapedByte();
+                        if (hi == -1) return -1;
+                    } else {
+                        hi = (unsigned char)*p++;
+                    }
+                    if (hi < lo) {
+                        err = "bad range in []";
+                        return -1;
+                    }
+                }
+                for (int c = lo; c <= hi; c++) reSetAdd(sets[set], c);
+            }
+            if (p == end) {
+                err = "missing ]";
+                return -1;
+            }
+            p++;
+            fold(sets[set]);
+            if (negate) {
+                for (int k = 0; k < 4; k++) sets[set].bits[k] = ~sets[set].bits[k];
+            }
+            sets[set].bits[0] &= ~((uint64_t)1 << '\n');
+            return newAst(RA_SET, set);
+        }
+
+        int parseAtom() {
+            char c = *p++;
+            switch (c) {
+                case '(': {
+                    if (end - p >= 2 && p[0] == '?' && p[1] == ':') p += 2;
+                    int a = parseAlt();
+                    if (a == -1) return -1;
+                    if (p == end || *p != ')') {
+                        err = "missing )";
+                        return -1;
+                    }
+                    p++;
+                    return a;
+                }
+                case '[':
+                    return parseClass();
+                case '.': {
+                    int set = newSet();
+                    for (int k = 0; k < 4; k++) sets[set].bits[k] = ~(uint64_t)0;
+                    sets[set].bits[0] &= ~((uint64_t)1 << '\n');
+                    return newAst(RA_SET, set);
+                }
+                case '^':
+                    return newAst(RA_BOL);
+                case '$':
+                    return newAst(RA_EOL);
+                case '*': case '+': case '?':
+                    err = "nothing to repeat";
+                    return -1;
+            }
+            int set = newSet();
+            if (c == '\\') {
+                if (p == end) {
+                    err = "trailing \\";
+                    return -1;
+                }
+                if (strchr("dDwWsS", *p)) {
+                    addClass(sets[set], *p++);
+                    return newAst(RA_SET, set);
+                }
+                int b = escapedByte();
+                if (b == -1) return -1;
+                c = b;
+            }
+            reSetAdd(sets[set], c);
+            fold(sets[set]);
+            return newAst(RA_SET, set);
+        }
+
+        // Reads a decimal count of a {m,n} repeat, or returns -1
+        int parseCount() {
+            int v = -1;
+            while (p < end && *p >= '0' && *p <= '9') {
+                v = (v == -1 ? 0 : v) * 10 + (*p++ - '0');
+                if (v > RE_MAX_REPEAT) return RE_MAX_REPEAT + 1;
+            }
+            return v;
+        }
+
+        int parseRepeat() {
+            int a = parseAtom();
+            while (a != -1 && p < end) {
+                int min, max;
+                if (*p == '*') {
+                    min = 0;
+                    max = -1;
+                    p++;
+                } else if (*p == '+') {
+                    min = 1;
+                    max = -1;
+                    p++;
+                } else if (*p == '?') {
+                    min = 0;
+                    max = 1;
+                    p++;
+                } else if (*p == '{') {
+                    // Not a count, so a literal {
+                    const char *save = p++;
+                    min = parseCount();
+                    max = min;
+                    if (p < end && *p == ',') {
+                        p++;
+                        max = parseCount();
+                    }
+                    if (min == -1 || p == end || *p != '}') {
+                        p = save;
+                        break;
+                    }
+                    p++;
+                    if (min > RE_MAX_REPEAT || max > RE_MAX_REPEAT || (max != -1 && max < min)) {
+                        err = "bad {} count";
+                        return -1;
+                    }
+                } else {
+                    break;
+                }
+                // Lazy and possessive forms find the same matches here
+                if (p < end && (*p == '?' || *p == '+')) p++;
+                int r = newAst(RA_REP, -1, min, max);
+                ast[r].kids.push_back(a);
+                a = r;
+            }
+            return a;
+        }
+
+        int parseCat() {
+            std::vector<int> kids;
+            while (p < end && *p != '|' && *p != ')') {
+                int a = parseRepeat();
+                if (a == -1) return -1;
+                kids.push_back(a);
+            }
+            if (kids.empty()) return newAst(RA_EMPTY);
+            if (kids.size() == 1) return kids[0];
+            int c = newAst(RA_CAT);
+            ast[c].kids = kids;
+            return c;
+        }
+
+        int parseAlt() {
+            std::vector<int> kids;
+            int a = parseCat();
+            if (a == -1) return -1;
+            kids.push_back(a);
+            while (p < end && *p == '|') {
+                p++;
+                a = parseCat();
+                if (a == -1) return -1;
+                kids.push_back(a);
+            }
+            if (kids.size() == 1) return kids[0];
+            int alt = newAst(RA_ALT);
+            ast[alt].kids = kids;
+            return alt;
+        }
+
+        bool nullable(int a) const {
+            const reAst &n = ast[a];
+            switch (n.op) {
+                case RA_SET:
+                    return false;
+                case RA_CAT:
+                    for (int k : n.kids) if (!nullable(k)) return false;
+                    return true;
+                case RA_ALT:
+                    for (int k : n.kids) if (nullable(k)) return true;
+                    return false;
+                case RA_REP:
+                    return n.min == 0 || nullable(n.kids[0]);
+            }
+            return true;
+        }
+
+        int newNode(std::vector<reNode> &nfa, int op, int set, int out, int out1) {
+            nfa.push_back(reNode{ op, set, out, out1 });
+            return nfa.size() - 1;
+        }
+
+        // Builds a into nfa so that it continues to next. Returns the node
+        // it starts at, or -1 when the NFA grows too large.
+        int build(std::vector<reNode> &nfa, int a, int next, bool reversed) {
+            if (nfa.size() > RE_MAX_NODES || next == -1) return -1;
+            const reAst &n = ast[a];
+            switch (n.op) {
+                case RA_SET:
+                    return newNode(nfa, RE_CHAR, n.set, next, -1);
+                case RA_BOL:
+                    return newNode(nfa, reversed ? RE_EOL : RE_BOL, -1, next, -1);
+                case RA_EOL:
+                    return newNode(nfa, reversed ? RE_BOL : RE_EOL, -1, next, -1);
+                case RA_EMPTY:
+                    return next;
+                case RA_CAT:
+                    if (reversed) {
+                        for (size_t k = 0; k < n.kids.size(); k++) next = build(nfa, n.kids[k], next, reversed);
+                    } else {
+                        for (size_t k = n.kids.size(); k-- > 0;) next = build(nfa, n.kids[k], next, reversed);
+                    }
+                    return next;
+                case RA_ALT: {
+                    int s = build(nfa, n.kids.back(), next, reversed);
+                    for (size_t k = n.kids.size() - 1; k-- > 0;) {
+                        int first = build(nfa, n.kids[k], next, reversed);
+                        if (first == -1 || s == -1) return -1;
+                        s = newNode(nfa, RE_SPLIT, -1, first, s);
+                    }
+                    return s;
+                }
+                case RA_REP: {
+                    int kid = n.kids[0];
+                    int cur = next;
+                    if (n.max == -1) {
+                        int loop = newNode(nfa, RE_SPLIT, -1, -1, next);
+                        int body = build(nfa, kid, loop, reversed);
+                        if (body == -1) return -1;
+                        nfa[loop].out = body;
+                        cur = loop;
+                    } else {
+                        for (int k = n.min; k < n.max; k++) {
+                            int body = build(nfa, kid, cur, reversed);
+                            if (body == -1) return -1;
+                            cur = newNode(nfa, RE_SPLIT, -1, body, next);
+                        }
+                    }
+                    // The copies every match goes through, so a+ is a a*
+                    for (int k = 0; k < n.min; k++) cur = build(nfa, kid, cur, reversed);
+                    return cur;
+                }
+            }
+            return -1;
+        }
+
+        // The byte a one byte set stands for, folded, or -1
+        int literalByte(int set) const {
+            int found = -1, count = 0;
+            for (int c = 0; c < 256; c++) {
+                if (!reSetHas(sets[set], c)) continue;
+                count++;
+                if (found == -1) found = c;
+            }
+            if (count == 1) return found;
+            if (icase && count == 2 && found >= 'A' && found <= 'Z' && reSetHas(sets[set], found + 32)) {
+                return found + 32;
+            }
+            return -1;
+        }
+
+        // Collects the runs of literal bytes in a concatenation, flattening
+        // groups, and keeps the longest in lit
+        void findLiteral(int a, std::string &run) {
+            const reAst &n = ast[a];
+            int b = (n.op == RA_SET) ? literalByte(n.set) : -1;
+            if (b != -1) {
+                run.push_back(b);
+            } else if (n.op == RA_CAT) {
+                for (int k : n.kids) findLiteral(k, run);
+                return;
+            } else if (n.op == RA_BOL || n.op == RA_EOL || n.op == RA_EMPTY) {
+                return;
+            } else {
+                run.clear();
+            }
+            if (run.size() > lit.size()) lit = run;
+        }
+
+        void initDfas() {
+            anchored.init(&fwd, &sets, fwdEntry, false);
+            search.init(&fwd, &sets, fwdEntry, true);
+            reverse.init(&rev, &sets, revEntry, true);
+        }
+
+    public:
+        Regex() {}
+
+        Regex(const Regex &o) {
+            *this = o;
+        }
+
+        // Copies the pattern, with caches of its own
+        Regex &operator=(const Regex &o) {
+            if (this == &o) return *this;
+            sets = o.sets;
+            ast = o.ast;
+            root = o.root;
+            fwd = o.fwd;
+            rev = o.rev;
+            fwdEntry = o.fwdEntry;
+            revEntry = o.revEntry;
+            icase = o.icase;
+            lit = o.lit;
+            litpat = o.litpat;
+            cancelGen = nullptr;
+            initDfas();
+            return *this;
+        }
+
+        // Returns false with the reason in error when s[0, len) is not a
+        // pattern this engine takes
+        bool compile(const char *s, size_t len, bool ignoreCase, std::string &error) {
+            sets.clear();
+            ast.clear();
+            fwd.clear();
+            rev.clear();
+            lit.clear();
+            icase = ignoreCase;
+            p = s;
+            end = s + len;
+            err.clear();
+            root = parseAlt();
+            if (root != -1 && p != end) err = "unmatched )";
+            if (err.empty() && nullable(root)) err = "pattern matches empty text";
+            if (err.empty()) {
+                int m = newNode(fwd, RE_MATCH, -1, -1, -1);
+                fwdEntry = build(fwd, root, m, false);
+                m = newNode(rev, RE_MATCH, -1, -1, -1);
+                revEntry = build(rev, root, m, true);
+                if (fwdEntry == -1 || revEntry == -1) err = "pattern too large";
+            }
+            if (!err.empty()) {
+                error = err;
+                fwd.clear();
+                rev.clear();
+                root = -1;
+                return false;
+            }
+            std::string run;
+            findLiteral(root, run);
+            litpat.compile(lit.data(), lit.size(), icase);
+            initDfas();
+            return true;
+        }
+
+        bool compiled() const { return root != -1; }
+
+        // A substring every match holds, may be empty
+        const std::string &literal() const { return lit; }
+        const SearchPattern &prefilter() const { return litpat; }
+
+        // Whether the line s[0, n), without its newline, holds a match that
+        // starts at from or after it
+        bool lineHasMatch(const char *s, size_t n, size_t from = 0) {
+            int st = search.start(from == 0);
+            for (size_t i = from; i < n; i++) {
+                st = search.step(st, s[i]);
+                if (i + 1 == n ? search.matchEnd(st) : search.match(st)) return true;
+            }
+            return false;
+        }
+
+        // Length of the longest match starting at s[at] in the line s[0, n),
+        // or 0 when none does. Gives up with *longer set when the DFA is
+        // still alive limit bytes on.
+        size_t matchAt(const char *s, size_t n, size_t at, size_t limit = SIZE_MAX, bool *longer = nullptr) {
+            int st = anchored.start(at == 0);
+            size_t best = 0;
+            size_t stop = n - at > limit ? at + limit : n;
+            for (size_t i = at; i < n; i++) {
+                if (i == stop) {
+                    *longer = true;
+                    return 0;
+                }
+                st = anchored.step(st, s[i]);
+                if (anchored.dead(st)) break;
+                if (i + 1 == n ? anchored.matchEnd(st) : anchored.match(st)) best = i + 1 - at;
+            }
+            return best;
+        }
+
+        // Makes lineMatches give up once *gen is no longer want. For a
+        // thread that may be told to stop while inside a long line.
+        void cancelWhen(const std::atomic<unsigned> *gen, unsigned want) {
+            cancelGen = gen;
+            cancelWant = want;
+            cancelled = false;
+        }
+
+    private:
+        bool tick(size_t bytes) {
+            ticks += bytes;
+            if (ticks < RE_CANCEL_STRIDE) return cancelled;
+            ticks = 0;
+            if (cancelGen && cancelGen -> load(std::memory_order_relaxed) != cancelWant) cancelled = true;
+            return cancelled;
+        }
+
+        void memoReset(size_t n) {
+            memoHead.assign(n / RE_MEMO_STRIDE + 1, -1);
+            memo.clear();
+            memoGen = anchored.generation();
+        }
+
+        // As matchAt, but within one lineMatches call. The scan from at
+        // stops as soon as it is in a state a scan before it was in at the
+        // same position, since from there on the two see the same text and
+        // go the same way: it takes the furthest end the earlier scan found.
+        // The states a scan passes at every RE_MEMO_STRIDE-th position are
+        // then recorded with the furthest end ahead of them. A position is
+        // reached in few distinct states, so the scans together read each
+        // byte a bounded number of times, and the memo takes a few bytes
+        // per RE_MEMO_STRIDE bytes of line.
+        size_t longestFrom(const char *s, size_t n, size_t at) {
+            int st = anchored.start(at == 0);
+            if (anchored.generation() != memoGen) memoReset(n);
+            path.clear();
+            size_t seen = 0; // furthest end passed, even before a cache flush
+            size_t far = 0;
+            size_t j = at;
+            while (1) {
+                if (j % RE_MEMO_STRIDE == 0) {
+                    int k = memoHead[j / RE_MEMO_STRIDE];
+                    while (k != -1 && memo[k].state != st) k = memo[k].next;
+                    if (k != -1) {
+                        far = memo[k].far;
+                        break;
+                    }
+                    path.push_back(reStep{ st, j, 0 });
+                }
+                if (j > at && (j == n ? anchored.matchEnd(st) : anchored.match(st))) {
+                    seen = j;
+                    if (!path.empty()) path.back().last = j;
+                }
+                if (j == n || anchored.dead(st)) break;
+                st = anchored.step(st, s[j++]);
+                if ((j & 4095) == 0 && tick(4096)) return 0;
+                if (anchored.generation() != memoGen) {
+                    // The cache started over and the ids on the path are stale
+                    memoReset(n);
+                    path.clear();
+                }
+            }
+            for (size_t i = path.size(); i-- > 0;) {
+                if (far < path[i].last) far = path[i].last;
+                size_t c = path[i].pos / RE_MEMO_STRIDE;
+                memo.push_back(reMemo{ path[i].state, memoHead[c], far });
+                memoHead[c] = memo.size() - 1;
+            }
+            if (far < seen) far = seen;
+            return far > at ? far - at : 0;
+        }
+
+    public:
+        // Calls fn(start, len) for each leftmost longest match in the line
+        // s[0, n), the next one looked for after the end of the last, until
+        // fn returns false. Returns false when it was stopped or cancelled.
+        // The listing starts at from, which must be 0 or a match an earlier
+        // listing gave for the later matches to be the same.
+        template <typename F>
+        bool lineMatches(const char *s, size_t n, F fn, size_t from = 0) {
+            if (tick(n - from)) return false;
+            if (!lineHasMatch(s, n, from)) return true;
+            begins.assign(n - from, 0);
+            int st = reverse.start(true);
+            for (size_t i = n; i-- > from;) {
+                st = reverse.step(st, s[i]);
+                if (i == 0 ? reverse.matchEnd(st) : reverse.match(st)) begins[i - from] = 1;
+            }
+            if (tick(n - from)) return false;
+            // Scans that end early are cheaper without the memo. Once one
+            // runs long, the rest of the line goes through longestFrom.
+            bool memoOn = false;
+            for (size_t i = from; i < n; i++) {
+                if (!begins[i - from]) continue;
+                size_t len = 0;
+                if (!memoOn) {
+                    if (tick(RE_MEMO_AFTER)) return false;
+                    len = matchAt(s, n, i, RE_MEMO_AFTER, &memoOn);
+                    if (memoOn) memoReset(n);
+                }
+                if (memoOn) len = longestFrom(s, n, i);
+                if (cancelled) return false;
+                if (len == 0) continue;
+                if (!fn(i, len)) return false;
+                i += len - 1;
+            }
+            return true;
+        }
+};
+
+// Runs a Regex over text that arrives a block at a time and reports the
+// offset of every match, in order. The text must start at a line start and
+// be whole lines. Lines are matched in place, and only copied when they run
+// across two blocks.
+class RegexStream {
+    private:
+        Regex &re;
+        size_t base;      // offset of the next block
+        size_t from;      // offset the listing starts at
+        std::string line; // start of a line the last block ended in
+        bool partial = false;
+
+        // A CRLF line is matched without its '\r', as it is drawn
+        template <typename F>
+        bool matchLine(const char *s, size_t n, size_t at, F &match) {
+            if (n > 0 && s[n - 1] == '\r') n--;
+            size_t skip = from > at ? from - at : 0;
+            return re.lineMatches(s, n, [&](size_t start, size_t) {
+                return match(at + start);
+            }, skip < n ? skip : n);
+        }
+
+    public:
+        // The text starts at start. Matches are listed from the offset from
+        // on, which is start or a match a listing from the start of its
+        // line gave, so the ones after it are the same.
+        RegexStream(Regex &r, size_t start, size_t listFrom = 0) : re(r), base(start), from(listFrom) {}
+
+        // Calls match(offset) for each match in the lines that end in
+        // s[0, n), until it returns false. Returns false when it was stopped.
+        template <typename F>
+        bool feed(const char *s, size_t n, F match) {
+            const SearchPattern &lit = re.prefilter();
+            size_t i = 0;
+            if (partial) {
+                const char *nl = (const char *)memchr(s, '\n', n);
+                if (nl == NULL) {
+                    line.append(s, n);
+                    base += n;
+                    return true;
+                }
+                line.append(s, nl - s);
+                partial = false;
+                bool hit = lit.length() == 0 || lit.find(line.data(), line.size()) != SearchPattern::npos;
+                if (hit && !matchLine(line.data(), line.size(), base - (line.size() - (nl - s)), match)) return false;
+                i = nl - s + 1;
+            }
+            while (i < n) {
+                size_t from = i;
+                if (lit.length() > 0) {
+                    size_t at = lit.find(s + i, n - i);
+                    if (at == SearchPattern::npos) {
+                        // A hit may still run into the next block
+                        const char *last = (const char *)memrchr(s + i, '\n', n - i);
+                        from = last ? last + 1 - s : i;
+                        line.assign(s + from, n - from);
+                        partial = true;
+                        break;
+                    }
+                    const char *start = (const char *)memrchr(s + i, '\n', at);
+                    from = start ? start + 1 - s : i;
+                }
+                const char *nl = (const char *)memchr(s + from, '\n', n - from);
+                if (nl == NULL) {
+                    line.assign(s + from, n - from);
+                    partial = true;
+                    break;
+                }
+                if (!matchLine(s + from, nl - (s + from), base + from, match)) return false;
+                i = nl - s + 1;
+            }
+            base += n;
+            return true;
+        }
+
+        // Matches the last line, when the text did not end in a newline.
+        // Returns false when it was stopped.
+        template <typename F>
+        bool finish(F match) {
+            if (!partial) return true;
+            partial = false;
+            return matchLine(line.data(), line.size(), base - line.size(), match);
+        }
+};
@@ -0,0 +1,55 @@
+#pragma once
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+/*** Ring Buffer ***/
+// Fixed-size byte queue. Input is read into it in as large chunks as the
+// terminal has ready, and keys are decoded out of it without further system
+// calls.
+
+#define RING_SIZE (64 * 1024) // must be a power of two
+
+class Ring {
+    private:
+        char data[RING_SIZE];
+        size_t head = 0;  // index of the oldest byte
+        size_t count = 0;
+
+    public:
+        size_t size() const { return count; }
+        size_t space() const { return RING_SIZE - count; }
+
+        unsigned char at(size_t i) const {
+            return data[(head + i) & (RING_SIZE - 1)];
+        }
+
+        // Appends up to n bytes of s, as much as there is space for
+        size_t push(const char *s, size_t n) {
+            if (n > space()) n = space();
+            for (size_t j = 0; j < n; j++) data[(head + count + j) & (RING_SIZE - 1)] = s[j];
+            count += n;
+            return n;
+        }
+
+        void drop(size_t n) {
+            if (n > count) n = count;
+            head = (head + n) & (RING_SIZE - 1);
+            count -= n;
+        }
+
+        // Reads what fd has ready into the free space with a single call.
+        // Returns what read returns.
+        ssize_t fill(int fd) {
+            size_t tail = (head + count) & (RING_SIZE - 1);
+            size_t first = RING_SIZE - tail;
+            if (first > space()) first = space();
+            struct iovec iov[2] = {
+                { data + tail, first },
+                { data, space() - first },
+            };
+            ssize_t n = readv(fd, iov, 2);
+            if (n > 0) count += n;
+            return n;
+        }
+};
@@ -0,0 +1,90 @@
+#pragma once
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+/*** Screen Model ***/
+// Remembers what the terminal is showing as one hash per screen line, so a
+// frame only has to send the lines whose contents changed. A vertical scroll
+// is done by the terminal itself: the lines that are still in view move with
+// it and only the ones scrolled in need drawing. Also counts the bytes
+// written per frame.
+
+class Screen {
+    private:
+        std::vector<uint64_t> lines; // 0 when the line is unknown
+        int cursorRow = -1, cursorCol = -1;
+        int top = -1, left = -1; // text position shown in the top left cell
+
+        static uint64_t hash(const char *s, size_t len) {
+            uint64_t h = 14695981039346656037ull;
+            for (size_t j = 0; j < len; j++) {
+                h ^= (unsigned char)s[j];
+                h *= 1099511628211ull;
+            }
+            return h ? h : 1;
+        }
+
+    public:
+        size_t frameBytes = 0; // written by the last frame
+        size_t totalBytes = 0;
+        size_t frames = 0;
+
+        // Forgets the terminal contents, so the next frame repaints it all
+        void invalidate() {
+            lines.assign(lines.size(), 0);
+            cursorRow = cursorCol = -1;
+            top = left = -1;
+        }
+
+        void resize(int rows) {
+            if ((int)lines.size() == rows) return;
+            lines.assign(rows, 0);
+            top = left = -1;
+        }
+
+        // Records that the first rows lines now show the text from row top
+        // and column left. Returns by how many lines the terminal can scroll
+        // them to get there, or 0 when they have to be drawn anew.
+        int follow(int newTop, int newLeft, int rows) {
+            int delta = newTop - top;
+            int ok = top != -1 && newLeft == left && delta != 0 && delta < rows && -delta < rows;
+            top = newTop;
+            left = newLeft;
+            return ok ? delta : 0;
+        }
+
+        // Moves the first rows lines up by n, or down when n is negative, the
+        // way the terminal does when that region scrolls. The lines scrolled
+        // in are blank.
+        void scroll(int rows, int n) {
+            if (n > 0) {
+                for (int y = 0; y < rows; y++) lines[y] = y + n < rows ? lines[y + n] : 0;
+            } else {
+                for (int y = rows - 1; y >= 0; y--) lines[y] = y + n >= 0 ? lines[y + n] : 0;
+            }
+        }
+
+        // Records line y as holding s[0, len). Returns whether it has to be
+        // written.
+        bool update(int y, const char *s, size_t len) {
+            uint64_t h = hash(s, len);
+            if (lines[y] == h) return false;
+            lines[y] = h;
+            return true;
+        }
+
+        // Records the cursor position. Returns whether it moved.
+        bool moveCursor(int row, int col) {
+            if (row == cursorRow && col == cursorCol) return false;
+            cursorRow = row;
+            cursorCol = col;
+            return true;
+        }
+
+        void frame(size_t bytes) {
+            frameBytes = bytes;
+            totalBytes += bytes;
+            frames++;
+        }
+};
@@ -0,0 +1,181 @@
+#pragma once
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "Simd.h"
+
+/*** Search Pattern ***/
+// A query compiled for scanning large blocks of text. On x86 candidates are
+// found by comparing the first and last byte of the query at 16 or 32
+// positions at once, and only those are compared in full. Elsewhere, and for
+// the tail of a block, Horspool's bad character shift skips through the
+// text. Case folding is ASCII only.
+
+class SearchPattern {
+    private:
+        std::string pat;          // folded when icase
+        bool icase = false;
+        size_t skip[256];         // shift keyed by the byte under the last position
+        size_t rskip[256];        // shift backwards keyed by the byte under the first
+        unsigned char fold[256];
+
+        bool equalAt(const char *s) const {
+            size_t m = pat.size();
+            if (!icase) return memcmp(s, pat.data(), m) == 0;
+            for (size_t k = 0; k < m; k++) {
+                if (fold[(unsigned char)s[k]] != (unsigned char)pat[k]) return false;
+            }
+            return true;
+        }
+
+        size_t findHorspool(const char *s, size_t n, size_t i) const {
+            size_t m = pat.size();
+            unsigned char last = pat[m - 1];
+            while (i + m <= n) {
+                unsigned char c = fold[(unsigned char)s[i + m - 1]];
+                if (c == last && equalAt(s + i)) return i;
+                i += skip[c];
+            }
+            return npos;
+        }
+
+#ifdef GLYPH_SIMD_X86
+        // The byte a text byte is ORed with before comparing it against a
+        // folded pattern byte: 0x20 turns upper case letters into lower case
+        uint8_t caseBit(unsigned char c) const {
+            return icase && c >= 'a' && c <= 'z' ? 0x20 : 0;
+        }
+
+        size_t findSSE2(const char *s, size_t n) const {
+            size_t m = pat.size();
+            const __m128i first = _mm_set1_epi8(pat[0]);
+            const __m128i last = _mm_set1_epi8(pat[m - 1]);
+            const __m128i firstCase = _mm_set1_epi8(caseBit(pat[0]));
+            const __m128i lastCase = _mm_set1_epi8(caseBit(pat[m - 1]));
+            size_t i = 0;
+            for (; i + m - 1 + 16 <= n; i += 16) {
+                __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)(s + i)), firstCase);
+                __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(s + i + m - 1)), lastCase);
+                uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                    _mm_cmpeq_epi8(b, last)));
+                while (mask) {
+                    size_t j = i + __builtin_ctz(mask);
+                    if (equalAt(s + j)) return j;
+                    mask &= mask - 1;
+                }
+            }
+            return findHorspool(s, n, i);
+        }
+
+        __attribute__((target("avx2")))
+        size_t findAVX2(const char *s, size_t n) const {
+            size_t m = pat.size();
+            const __m256i first = _mm256_set1_epi8(pat[0]);
+            const __m256i last = _mm256_set1_epi8(pat[m - 1]);
+            const __m256i firstCase = _mm256_set1_epi8(caseBit(pat[0]));
+            const __m256i lastCase = _mm256_set1_epi8(caseBit(pat[m - 1]));
+            size_t i = 0;
+            for (; i + m - 1 + 32 <= n; i += 32) {
+                __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(s + i)), firstCase);
+                __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(s + i + m - 1)), lastCase);
+                uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                    _mm256_cmpeq_epi8(b, last)));
+                while (mask) {
+                    size_t j = i + __builtin_ctz(mask);
+                    if (equalAt(s + j)) return j;
+                    mask &= mask - 1;
+                }
+            }
+            return findHorspool(s, n, i);
+        }
+#endif
+
+    public:
+        static constexpr size_t npos = (size_t)-1;
+
+        void compile(const char *s, size_t len, bool ignoreCase) {
+            icase = ignoreCase;
+            for (int c = 0; c < 256; c++) {
+                fold[c] = icase && c >= 'A' && c <= 'Z' ? c + 32 : c;
+            }
+            pat.resize(len);
+            for (size_t k = 0; k < len; k++) pat[k] = fold[(unsigned char)s[k]];
+            for (int c = 0; c < 256; c++) skip[c] = rskip[c] = len;
+            for (size_t k = 0; k + 1 < len; k++) skip[(unsigned char)pat[k]] = len - 1 - k;
+            for (size_t k = len - 1; k >= 1 && k < len; k--) rskip[(unsigned char)pat[k]] = k;
+        }
+
+        size_t length() const { return pat.size(); }
+
+        // Whether s[0, length()) is a match
+        bool matches(const char *s) const { return equalAt(s); }
+
+        bool ignoresCase() const { return icase; }
+
+        // Offset of the first match in s[0, n), or npos
+        size_t find(const char *s, size_t n) const {
+            if (pat.empty() || n < pat.size()) return npos;
+#ifdef GLYPH_SIMD_X86
+            if (simdHasAVX2()) return findAVX2(s, n);
+            return findSSE2(s, n);
+#else
+            return findHorspool(s, n, 0);
+#endif
+        }
+
+        // Offset of the last match in s[0, n), or npos
+        size_t rfind(const char *s, size_t n) const {
+            size_t m = pat.size();
+            if (m == 0 || n < m) return npos;
+            unsigned char first = pat[0];
+            size_t i = n - m;
+            for (;;) {
+                unsigned char c = fold[(unsigned char)s[i]];
+                if (c == first && equalAt(s + i)) return i;
+                if (i < rskip[c]) return npos;
+                i -= rskip[c];
+            }
+        }
+};
+
+// Runs a pattern over text that arrives a block at a time, such as the spans
+// of the piece table, and reports every match in order, including those that
+// run across blocks. Those are found in the seam: the last length - 1 bytes
+// fed so far joined to the first length - 1 of the new block.
+class SearchStream {
+    private:
+        const SearchPattern &pat;
+        size_t base;       // offset of the next block
+        std::string seam;
+
+    public:
+        SearchStream(const SearchPattern &p, size_t start) : pat(p), base(start) {}
+
+        // Calls match(offset) for each match that ends in s[0, n), until it
+        // returns false. Returns false when it was stopped.
+        template <typename F>
+        bool feed(const char *s, size_t n, F match) {
+            size_t m = pat.length();
+            size_t tail = seam.size();
+            size_t i, at;
+            if (tail > 0) {
+                seam.append(s, n < m - 1 ? n : m - 1);
+                for (i = 0; (at = pat.find(seam.data() + i, seam.size() - i)) != SearchPattern::npos; i += at + 1) {
+                    if (!match(base - tail + i + at)) return false;
+                }
+            }
+            for (i = 0; (at = pat.find(s + i, n - i)) != SearchPattern::npos; i += at + 1) {
+                if (!match(base + i + at)) return false;
+            }
+            if (n >= m - 1) {
+                seam.assign(s + n - (m - 1), m - 1);
+            } else {
+                seam.resize(tail);
+                seam.append(s, n);
+                if (seam.size() > m - 1) seam.erase(0, seam.size() - (m - 1));
+            }
+            base += n;
+            return true;
+        }
+};
@@ -0,0 +1,155 @@
+#pragma once
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define GLYPH_SIMD_X86 1
+#endif
+
+/*** SIMD Kernels ***/
+// Byte scanning kernels. x86 builds get SSE2 and AVX2 versions, with AVX2
+// picked at run time so the binary still runs on older machines. Other
+// targets use the portable loop.
+
+// Control bytes are the ones iscntrl reports in the C locale: 0x00-0x1f and
+// 0x7f. Tabs are among them.
+static inline bool isControlByte(unsigned char c) {
+    return c < 0x20 || c == 0x7f;
+}
+
+// Offsets are relative to base. Scanning may look at base[from - 1] to see
+// whether the first newline of the range ends a CRLF pair.
+static inline size_t scanNewlinesScalar(const char *base, size_t i, size_t to,
+        std::vector<size_t> &nl) {
+    size_t crlf = 0;
+    for (; i < to; i++) {
+        if (base[i] != '\n') continue;
+        nl.push_back(i);
+        if (i > 0 && base[i - 1] == '\r') crlf++;
+    }
+    return crlf;
+}
+
+#ifdef GLYPH_SIMD_X86
+static inline size_t scanNewlinesSSE2(const char *base, size_t i, size_t to,
+        std::vector<size_t> &nl) {
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    uint32_t carry = (i > 0 && base[i - 1] == '\r');
+    size_t crlf = 0;
+    for (; i + 16 <= to; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(base + i));
+        uint32_t lfmask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+        uint32_t crmask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+        crlf += __builtin_popcount(lfmask & ((crmask << 1) | carry));
+        carry = crmask >> 15;
+        while (lfmask) {
+            nl.push_back(i + __builtin_ctz(lfmask));
+            lfmask &= lfmask - 1;
+        }
+    }
+    return crlf + scanNewlinesScalar(base, i, to, nl);
+}
+
+__attribute__((target("avx2")))
+static inline size_t scanNewlinesAVX2(const char *base, size_t i, size_t to,
+        std::vector<size_t> &nl) {
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    uint64_t carry = (i > 0 && base[i - 1] == '\r');
+    size_t crlf = 0;
+    for (; i + 32 <= to; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(base + i));
+        uint64_t lfmask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+        uint64_t crmask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cr));
+        crlf += __builtin_popcountll(lfmask & ((crmask << 1) | carry));
+        carry = crmask >> 31;
+        while (lfmask) {
+            nl.push_back(i + __builtin_ctzll(lfmask));
+            lfmask &= lfmask - 1;
+        }
+    }
+    return crlf + scanNewlinesScalar(base, i, to, nl);
+}
+
+// Mask of the control bytes in v. Bytes of 0x80 and up compare below 0x20
+// as signed values, so they are masked out again.
+static inline uint32_t controlMaskSSE2(__m128i v) {
+    __m128i low = _mm_and_si128(_mm_cmplt_epi8(v, _mm_set1_epi8(0x20)),
+        _mm_cmpgt_epi8(v, _mm_set1_epi8(-1)));
+    return _mm_movemask_epi8(_mm_or_si128(low, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f))));
+}
+
+static inline size_t findControlSSE2(const char *s, size_t i, size_t len) {
+    for (; i + 16 <= len; i += 16) {
+        uint32_t mask = controlMaskSSE2(_mm_loadu_si128((const __m128i *)(s + i)));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    for (; i < len; i++) if (isControlByte(s[i])) return i;
+    return len;
+}
+
+__attribute__((target("avx2")))
+static inline size_t findControlAVX2(const char *s, size_t i, size_t len) {
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i neg = _mm256_set1_epi8(-1);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i low = _mm256_and_si256(_mm256_cmpgt_epi8(space, v), _mm256_cmpgt_epi8(v, neg));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_or_si256(low, _mm256_cmpeq_epi8(v, del)));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return findControlSSE2(s, i, len);
+}
+
+static inline size_t countByteSSE2(const char *s, size_t len, char c) {
+    const __m128i needle = _mm_set1_epi8(c);
+    size_t count = 0, i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle)));
+    }
+    for (; i < len; i++) count += (s[i] == c);
+    return count;
+}
+
+static inline bool simdHasAVX2() {
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+#endif
+
+// Appends the offset of every '\n' in base[from, to) to nl and returns how
+// many of them end a CRLF pair
+static inline size_t simdFindNewlines(const char *base, size_t from, size_t to,
+        std::vector<size_t> &nl) {
+#ifdef GLYPH_SIMD_X86
+    if (simdHasAVX2()) return scanNewlinesAVX2(base, from, to, nl);
+    return scanNewlinesSSE2(base, from, to, nl);
+#else
+    return scanNewlinesScalar(base, from, to, nl);
+#endif
+}
+
+// Offset of the first control byte in s[0, len), or len when there is none
+static inline size_t simdFindControl(const char *s, size_t len) {
+#ifdef GLYPH_SIMD_X86
+    if (simdHasAVX2()) return findControlAVX2(s, 0, len);
+    return findControlSSE2(s, 0, len);
+#else
+    for (size_t i = 0; i < len; i++) if (isControlByte(s[i])) return i;
+    return len;
+#endif
+}
+
+static inline size_t simdCountByte(const char *s, size_t len, char c) {
+#ifdef GLYPH_SIMD_X86
+    return countByteSSE2(s, len, c);
+#else
+    size_t count = 0;
+    for (size_t i = 0; i < len; i++) count += (s[i] == c);
+    return count;
+#endif
+}
@@ -0,0 +1,155 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*** Tracing ***/
+// Scoped spans on the hot paths, recorded when GLYPH_TRACE names a file and
+// written there as Chrome trace JSON on the way out (chrome://tracing,
+// Perfetto).
+// Each thread appends to a ring of its own, so recording takes no lock and
+// only the newest TRACE_RING events of a thread are kept. Disabled, a span
+// costs one load and a branch at each end.
+
+#define TRACE_RING (1 << 16) // events kept per thread, a power of two
+
+#define TRACE_CAT2(a, b) a##b
+#define TRACE_CAT(a, b) TRACE_CAT2(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CAT(traceScope, __LINE__)(name)
+
+struct traceEvent {
+    const char *name; // a string literal
+    long long ts;     // ns on the monotonic clock
+    long long dur;    // ns, or the value of a counter
+    int counter;
+};
+
+// The events of one thread. A thread that exits hands its ring on to the
+// next one of the same name, so short-lived threads share lanes in the trace.
+struct TraceRing {
+    traceEvent events[TRACE_RING];
+    std::atomic<size_t> head{0}; // events ever written
+    int tid;
+    const char *name = "thread";
+};
+
+inline int traceOn = 0; // set before any thread is started, then only read
+inline const char *tracePath;
+inline long long traceOrigin;
+inline std::mutex traceLock; // guards the ring lists
+inline std::vector<TraceRing *> traceRings;
+inline std::vector<TraceRing *> traceFree;
+
+struct TraceLane {
+    TraceRing *ring = nullptr;
+    ~TraceLane() {
+        if (!ring) return;
+        std::lock_guard<std::mutex> guard(traceLock);
+        traceFree.push_back(ring);
+    }
+};
+inline thread_local TraceLane traceLane;
+
+static inline long long traceNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline TraceRing *traceAttach(const char *name) {
+    std::lock_guard<std::mutex> guard(traceLock);
+    for (size_t j = 0; j < traceFree.size(); j++) {
+        if (!strcmp(traceFree[j] -> name, name)) {
+            traceLane.ring = traceFree[j];
+            traceFree.erase(traceFree.begin() + j);
+            return traceLane.ring;
+        }
+    }
+    traceLane.ring = new TraceRing();
+    traceLane.ring -> tid = traceRings.size() + 1;
+    traceLane.ring -> name = name;
+    traceRings.push_back(traceLane.ring);
+    return traceLane.ring;
+}
+
+static inline TraceRing *traceRing() {
+    return traceLane.ring ? traceLane.ring : traceAttach("thread");
+}
+
+static inline void traceRecord(const char *name, long long ts, long long dur, int counter) {
+    TraceRing *ring = traceRing();
+    size_t h = ring -> head.load(std::memory_order_relaxed);
+    traceEvent &e = ring -> events[h & (TRACE_RING - 1)];
+    e.name = name;
+    e.ts = ts;
+    e.dur = dur;
+    e.counter = counter;
+    ring -> head.store(h + 1, std::memory_order_release);
+}
+
+// Names the calling thread's lane. Call first thing in the thread.
+static inline void traceThread(const char *name) {
+    if (traceOn && !traceLane.ring) traceAttach(name);
+}
+
+static inline void traceCounter(const char *name, long long value) {
+    if (traceOn) traceRecord(name, traceNow(), value, 1);
+}
+
+class TraceScope {
+    private:
+        const char *name;
+        long long start;
+
+    public:
+        explicit TraceScope(const char *n) : name(n), start(traceOn ? traceNow() : -1) {}
+        TraceScope(const TraceScope&) = delete;
+        TraceScope& operator=(const TraceScope&) = delete;
+
+        ~TraceScope() {
+            if (start >= 0) traceRecord(name, start, traceNow() - start, 0);
+        }
+};
+
+// Writes the trace and stops recording. Call once every other thread that
+// records has been joined, so no ring is written to while it is read.
+static inline void traceDump() {
+    traceOn = 0;
+    FILE *fp = fopen(tracePath, "w");
+    if (!fp) return;
+    std::lock_guard<std::mutex> guard(traceLock);
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    const char *sep = "";
+    for (TraceRing *ring : traceRings) {
+        fprintf(fp, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+            sep, ring -> tid, ring -> name);
+        sep = ",\n";
+        size_t head = ring -> head.load(std::memory_order_acquire);
+        size_t first = head > TRACE_RING ? head - TRACE_RING : 0;
+        for (size_t j = first; j < head; j++) {
+            const traceEvent &e = ring -> events[j & (TRACE_RING - 1)];
+            double ts = (e.ts - traceOrigin) / 1000.0;
+            if (e.counter) {
+                fprintf(fp, ",\n{\"name\": \"%s\", \"ph\": \"C\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"args\": {\"value\": %lld}}",
+                    e.name, ring -> tid, ts, e.dur);
+            } else {
+                fprintf(fp, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                    e.name, ring -> tid, ts, e.dur / 1000.0);
+            }
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+}
+
+// Starts recording until traceDump. Call before starting threads.
+static inline void traceStart(const char *path) {
+    tracePath = path;
+    traceOrigin = traceNow();
+    traceOn = 1;
+    traceThread("main");
+}
@@ -7,18 +7,56 @@
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
 #include <vector>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <time.h>
 #include "Abuf.h"
+#include "PieceTable.h"
+#include "LineIndexer.h"
+#include "Keywords.h"
+#include "Screen.h"
+#include "Ring.h"
+#include "Search.h"
+#include "Regex.h"
+#include "Journal.h"
+#include "Trace.h"
+#include "Pool.h"
 #include <iostream>
 #include <string>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/uio.h>
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define GLYPH_VERSION "0.0.1"
 #define GLYPH_TAB_STOP 8
 #define GLYPH_QUIT_COUNT 3
+#define GLYPH_ROW_CACHE 1024
+#define GLYPH_ROW_SLACK 16     // spare bytes a row block gets, plus an eighth of its size
+#define GLYPH_HL_BATCH 512
+#define GLYPH_ESC_TIMEOUT 100  // ms to wait for the rest of an escape sequence
+#define GLYPH_LOAD_POLL 50     // ms between checks on the line indexer
+#define GLYPH_STATUS_TIMEOUT 5 // seconds a status message stays up
+#define GLYPH_MAX_FPS 60       // frame rate cap, GLYPH_FPS overrides it
+#define GLYPH_SAVE_IOV 64      // document spans written per writev
+#define GLYPH_SAVE_POLL 50     // ms between save progress updates
+#define GLYPH_FIND_CHUNK (4 << 20) // least bytes a search thread is given
+#define GLYPH_FIND_BLOCK (1 << 20) // bytes scanned between cancellation checks
+#define GLYPH_FIND_POLL 50     // ms between checks on a running search
+#define GLYPH_FIND_MAX 10000000 // matches indexed before counting stops
+#define GLYPH_FIND_RECHECK (1 << 16) // least candidates a search thread is given
+#define GLYPH_REPLACE_GAP 4096 // unchanged bytes copied to join two edits of a batch
+#define GLYPH_UNDO_MAX (64 << 20) // journal bytes kept before old steps are dropped
+#define GLYPH_UNDO_PAUSE 1000  // ms without typing that ends an undo step
 
 enum cursorKeys {
     BACKSPACE = 127,
@@ -31,6 +69,7 @@ enum cursorKeys {
     HOME_KEY,
     END_KEY,
     DEL_KEY,
+    PASTE_KEY, // a bracketed paste, its text is in E.paste
 };
 
 enum editorHighlight {
@@ -47,6 +86,15 @@ enum editorHighlight {
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+#define PROMPT_ALLOW_EMPTY (1<<0) // Enter on an empty prompt returns ""
+
+#define ROW_RENDER_VALID (1<<0)
+#define ROW_HL_VALID (1<<1)
+#define ROW_STATE_STALE (1<<2) // end state not rescanned since the last edit
+
+#define ROW_TABS (1<<0)
+#define ROW_CTRL (1<<1)
+
 struct editorSyntax {
     const char *filetype;
     const char **filematch;
@@ -55,19 +103,45 @@ struct editorSyntax {
     const char *multiline_comment_start;
     const char *multiline_comment_end;
     int flags;
+    KeywordTable kwtable; // keywords compiled when the syntax is first used
 };
 
 typedef struct erow {
     int idx;
     int size;
     int rsize;
-    char *chars;
+    int ccap;    // room for chars and its terminator
+    int rcap;    // room for render and its terminator, and for hl
+    size_t bsize; // what the block was asked of E.rowpool for, to release it
+    char *chars; // chars, render and hl share one block from E.rowpool
     char *render;
     unsigned char *hl;
-    int hl_open_comment;
+    int valid; // which of render and hl match chars
+    int special; // ROW_TABS and ROW_CTRL, known while render is valid
 } erow;
 
 /*** Data ***/
+struct editorTimer {
+    long long due; // editorNow() time to run at
+    void (*fn)();
+};
+
+// Bytes held by the cached rows, used and reserved, for tuning the pool
+struct editorRowMemory {
+    size_t rows;
+    size_t chars, charsCap;
+    size_t render, renderCap;
+    size_t hl, hlCap;
+    size_t headers;
+    poolStats pool;
+};
+
+// The matches of a shorter query kept while it is being typed on
+struct editorFindLevel {
+    std::string query;
+    std::vector<size_t> index;
+};
+
 struct editorConfig {
     int cx, cy;
     int rx;
@@ -76,7 +150,76 @@ struct editorConfig {
     int screencols;
     int numrows;
     int dirty;
-    erow *row;
+    PieceTable doc;
+    char *docbuf;      // original file text, mmap'd unless docmapped is 0
+    size_t docsize;
+    int docmapped;
+    LineIndexer indexer;
+    int loading;       // the indexer has not reached the end of the file yet
+    size_t crlfrows;   // indexed rows ending in CRLF
+    int crlf;          // new rows end in CRLF, following the file
+    std::vector<erow *> rows; // materialized rows, sorted by idx
+    Pool rowpool;      // the rows and their blocks
+    std::vector<unsigned char> hlstate; // multiline comment open at end of each row
+    int hlfront;       // hlstate is recorded for rows below this one
+    std::set<int> hldirty; // rows whose state may not follow from the row above
+    int hlstale;       // a row was drawn before its state was settled
+    int hlrepaint;     // the worker changed the state of a row in view
+    int hlquit;
+    std::mutex lock;   // guards everything the syntax worker reads
+    std::condition_variable hlwake;
+    std::thread hlworker;
+    Screen screen;     // what the terminal shows
+    Abuf frame;        // escape sequences of the frame being drawn
+    Abuf line;         // one screen line, compared against screen
+    Ring input;        // bytes read from the terminal, not yet decoded
+    int headless;      // no terminal, the replay harness drives the editor
+    Abuf sink;         // headless, what the terminal would have been sent
+    void (*nokey)();   // headless, puts more keys in input when it runs dry
+    int wakefd[2];     // written to wake the main thread from poll
+    volatile sig_atomic_t winch; // the terminal was resized
+    std::vector<editorTimer> timers;
+    int pasting;       // inside a bracketed paste
+    size_t pastematch; // bytes of the closing marker seen so far
+    std::string paste; // text of the current bracketed paste
+    int nextkey;       // key decoded ahead by editorInputPending, or -1
+    int frameinterval; // least ms between frames
+    long long lastframe; // editorNow() at the last frame
+    std::vector<erow *> hlpending; // rows with ROW_STATE_STALE set
+    std::thread saver;
+    int saving;        // saver is writing savespans out
+    std::vector<struct iovec> savespans; // the document when the save began
+    size_t savesize;
+    std::atomic<size_t> savedbytes; // written so far
+    std::atomic<int> savedone;
+    int saveerr;       // errno of the finished save, 0 when it succeeded
+    int savedirty;     // dirty when the save began
+    long long savestart;
+    long long saveus;  // how long the finished save took
+    int finding;       // the search prompt is open
+    SearchPattern findpat;
+    int findregex;     // the query is a regular expression
+    Regex findre;
+    std::string findreerr; // why the query is not a pattern this takes
+    std::vector<struct iovec> findspans; // the document when the search began
+    std::vector<size_t> findstarts; // offset of each span
+    std::vector<std::thread> finders;
+    std::vector<std::vector<size_t>> findparts; // matches found by each finder
+    std::atomic<unsigned> findgen; // bumped to cancel the running finders
+    std::atomic<int> findpending; // finders still scanning
+    int findready;     // findindex holds the matches of the current query
+    int findcapped;    // there were more than GLYPH_FIND_MAX matches
+    std::vector<size_t> findindex; // offset of every match, ascending
+    size_t findmatch;  // offset of the match at the cursor, or npos
+    std::string findquery; // the query findindex is for
+    std::vector<editorFindLevel> findlevels; // each a prefix of the next
+    long findcur;      // findmatch's position in findindex, or -1
+    Journal undo{GLYPH_UNDO_MAX};
+    unsigned long cleanstate; // undo.state() of the document on disk
+    unsigned long savestate;  // undo.state() when the save began
+    long long lastkey; // editorNowUs() at the last key
+    int overlay;       // GLYPH_OVERLAY is set, frame time and bytes are shown
+    long long frameus; // how long the last frame took to draw
     char *filename;
     char statusmsg[80];
     time_t statusmsg_time;
@@ -97,7 +240,8 @@ struct editorSyntax HLDB[] = {
         C_HL_extensions,
         C_HL_keywords,
         "//", "/*", "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        {}
     },
 };
 
@@ -107,13 +251,38 @@ struct editorConfig E;
 void editorSetStatusMessage(const char *fmt, ...);
 void editorDelChar();
 void editorInsertNewLine();
+void editorInsertText(const char *s, size_t len);
 int editorReadKey();
 void editorRefreshScreen();
-char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorShutdown();
+char *editorPrompt(const char *prompt, void (*callback)(char *, int), int flags);
+erow *editorRowAt(int at);
+erow *editorRowCached(int at);
+void editorPrepareRow(erow *row);
+void editorTrimRows();
+int editorPollLoad(int wait);
+void editorWaitLoaded();
+void editorReleaseDocBuf();
+int getWindowSize(int *rows, int *cols);
+void editorWaitEvents(long long timeout);
+long long editorNow();
+long long editorNowUs();
+int editorDecodeKey(int flush);
+void editorScheduleRefresh();
+void editorSyntaxFlush();
+void editorRowReserve(erow *row, int csize, int rsize);
+
+// Everything meant for the terminal goes through here
+void editorWriteOut(const char *s, size_t len) {
+    if (E.headless) E.sink.append(s, len);
+    else if (write(STDOUT_FILENO, s, len) == -1) {
+        // Nothing sensible to do about a terminal that went away
+    }
+}
 
 void die(const char *s) {
-    write(STDOUT_FILENO, "\x1b[2J", 4); // Clears the screen
-    write(STDOUT_FILENO, "\x1b[H", 3); // Repositions the cursor
+    editorWriteOut("\x1b[2J", 4); // Clears the screen
+    editorWriteOut("\x1b[H", 3); // Repositions the cursor
     // Display error message based on global errno variable
     perror(s);
     exit(1);
@@ -121,6 +290,7 @@ void die(const char *s) {
 
 /*** Terminal ***/
 void disableRawMode() {
+    editorWriteOut("\x1b[?2004l", 8);
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.original_termios) == -1) die("tcsetattr");
 }
 
@@ -146,18 +316,170 @@ void enableRawMode() {
     raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
     raw.c_cflag |= (CS8);
 
-    // Set a timeout duration for reading input
-    raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    // Reads return as soon as a byte is there. Input is only read once poll
+    // in the event loop reports some, so a read never waits on the terminal.
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+
+    // Have pasted text arrive between markers rather than as keystrokes
+    editorWriteOut("\x1b[?2004h", 8);
+}
+
+/*** Event Loop ***/
+// The editor sleeps in poll until there is input, a timer is due, or the
+// wake pipe is written to. The pipe is how the syntax worker and signal
+// handlers get the main thread's attention, so an idle editor uses no CPU.
+
+long long editorNowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+long long editorNow() {
+    return editorNowUs() / 1000;
+}
+
+// Wakes the main thread from poll. Safe to call from a signal handler.
+void editorWake() {
+    char c = 0;
+    if (write(E.wakefd[1], &c, 1) == -1) {
+        // Full pipe, a wake up is already pending
+    }
+}
+
+// Runs fn after ms milliseconds, replacing any pending timer for fn
+void editorSetTimer(int ms, void (*fn)()) {
+    long long due = editorNow() + ms;
+    for (editorTimer &t : E.timers) {
+        if (t.fn == fn) {
+            t.due = due;
+            return;
+        }
+    }
+    E.timers.push_back(editorTimer{ due, fn });
+}
+
+void editorCancelTimer(void (*fn)()) {
+    for (size_t j = 0; j < E.timers.size(); j++) {
+        if (E.timers[j].fn == fn) {
+            E.timers.erase(E.timers.begin() + j);
+            return;
+        }
+    }
+}
+
+void editorRunTimers() {
+    long long now = editorNow();
+    for (size_t j = 0; j < E.timers.size();) {
+        if (E.timers[j].due > now) {
+            j++;
+            continue;
+        }
+        void (*fn)() = E.timers[j].fn;
+        E.timers.erase(E.timers.begin() + j);
+        fn();
+        j = 0; // fn may have changed the list
+    }
+}
+
+void editorHandleResize() {
+    if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+    E.screenrows -= 2;
+    E.screen.invalidate();
+    editorRefreshScreen();
+}
+
+void editorHandleWinch(int sig) {
+    (void)sig;
+    E.winch = 1;
+    editorWake();
+}
+
+// Waits up to timeout milliseconds (forever when negative) for something to
+// happen and deals with it. New input is left in E.input.
+void editorWaitEvents(long long timeout) {
+    long long now = editorNow();
+    for (const editorTimer &t : E.timers) {
+        long long left = t.due > now ? t.due - now : 0;
+        if (timeout < 0 || left < timeout) timeout = left;
+    }
+
+    struct pollfd fds[2] = {
+        { E.headless ? -1 : STDIN_FILENO, POLLIN, 0 }, // poll skips -1
+        { E.wakefd[0], POLLIN, 0 },
+    };
+    // The syntax worker runs while the editor waits
+    E.hlwake.notify_one();
+    E.lock.unlock();
+    int n = poll(fds, 2, timeout < 0 ? -1 : (int)timeout);
+    E.lock.lock();
+    if (n == -1 && errno != EINTR) die("poll");
+
+    if (n > 0 && (fds[1].revents & POLLIN)) {
+        char drain[64];
+        while (read(E.wakefd[0], drain, sizeof(drain)) > 0);
+    }
+    if (n > 0 && (fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+        ssize_t nread = E.input.fill(STDIN_FILENO);
+        if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+        if (nread == 0) die("read");
+    }
+    if (E.winch) {
+        E.winch = 0;
+        editorHandleResize();
+    }
+    editorRunTimers();
+    if (E.hlrepaint) editorScheduleRefresh();
+}
+
+// Whether a whole key is waiting. Reads what the terminal has ready without
+// blocking, and keeps the key for editorReadKey.
+int editorInputPending() {
+    if (E.nextkey != -1) return 1;
+    struct pollfd fd = { STDIN_FILENO, POLLIN, 0 };
+    if (!E.headless && E.input.space() > 0 && poll(&fd, 1, 0) > 0 && (fd.revents & POLLIN)) {
+        E.input.fill(STDIN_FILENO);
+    }
+    E.nextkey = editorDecodeKey(0);
+    return E.nextkey != -1 || E.pasting;
+}
+
+void editorFrameTimer() {
+    editorRefreshScreen();
+}
+
+// Draws a frame now, or when the frame rate cap allows
+void editorScheduleRefresh() {
+    long long wait = E.lastframe + E.frameinterval - editorNow();
+    if (wait <= 0) editorRefreshScreen();
+    else editorSetTimer(wait, editorFrameTimer);
+}
+
+void editorInitEvents() {
+    if (pipe(E.wakefd) == -1) die("pipe");
+    for (int j = 0; j < 2; j++) {
+        fcntl(E.wakefd[j], F_SETFL, fcntl(E.wakefd[j], F_GETFL) | O_NONBLOCK);
+        fcntl(E.wakefd[j], F_SETFD, FD_CLOEXEC);
+    }
+    if (E.headless) return;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = editorHandleWinch;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
 }
 
 /*** Input ***/
 void editorInsertChar(int c);
 void editorSave();
 void editorFind();
+void editorReplace();
+void editorUndo();
+void editorRedo();
 
-char *editorPrompt(const char *prompt, void (*callback)(char *, int)) {
+char *editorPrompt(const char *prompt, void (*callback)(char *, int), int flags) {
     size_t bufsize = 128;
     char *buf = (char *)malloc(bufsize);
 
@@ -177,11 +499,21 @@ char *editorPrompt(const char *prompt, void (*callback)(char *, int)) {
             free(buf);
             return NULL;
         } else if (c == '\r') {
-            if (buflen != 0) {
+            if (buflen != 0 || (flags & PROMPT_ALLOW_EMPTY)) {
                 editorSetStatusMessage("");
                 if (callback) callback(buf, c);
                 return buf;
             }
+        } else if (c == PASTE_KEY) {
+            // Pasted text up to its first line break
+            for (size_t j = 0; j < E.paste.size() && E.paste[j] != '\r' && E.paste[j] != '\n'; j++) {
+                if (buflen == bufsize - 1) {
+                    bufsize *= 2;
+                    buf = (char *)realloc(buf, bufsize);
+                }
+                buf[buflen++] = E.paste[j];
+            }
+            buf[buflen] = '\0';
         } else if (!iscntrl(c) && c < 128) {
             if (buflen == bufsize - 1) {
                 bufsize *= 2;
@@ -194,54 +526,136 @@ char *editorPrompt(const char *prompt, void (*callback)(char *, int)) {
     }
 }
 
-int editorReadKey() {
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) die("read");
+// Moves the text of a bracketed paste out of the input. Returns PASTE_KEY
+// once the closing marker has arrived, -1 until then.
+int editorDecodePaste() {
+    static const char end[] = "\x1b[201~";
+    Ring &in = E.input;
+    size_t j;
+    for (j = 0; j < in.size(); j++) {
+        char c = in.at(j);
+        E.paste.push_back(c);
+        if (c == end[E.pastematch]) E.pastematch++;
+        else E.pastematch = (c == end[0]);
+        if (E.pastematch == sizeof(end) - 1) {
+            in.drop(j + 1);
+            E.paste.resize(E.paste.size() - (sizeof(end) - 1));
+            E.pasting = 0;
+            return PASTE_KEY;
+        }
     }
+    in.drop(j);
+    return -1;
+}
 
-    if (c == '\x1b') {
-        char seq[3];
-        if (read(STDIN_FILENO, &seq[0], 1) != 1 || read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-        
-        if (seq[0] == '[') {
-            if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-                if (seq[2] == '~') {
-                    switch (seq[1]) {
-                        case '1': return HOME_KEY;
-                        case '2': return END_KEY;
-                        case '3': return DEL_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '7': return HOME_KEY;
-                        case '8': return END_KEY;
-                    }
-                }
-            }
-            switch(seq[1]) {
-                case 'A': return ARROW_UP;
-                case 'B': return ARROW_DOWN;
-                case 'C': return ARROW_RIGHT;
-                case 'D': return ARROW_LEFT;
-                case 'H': return HOME_KEY;
-                case 'F': return END_KEY;
-            }
-        } else if (seq[0] == 'O') {
-            switch (seq[1]) {
-                case 'H': return HOME_KEY;
-                case 'F': return END_KEY; 
-            }
+// Decodes one key from the front of the input. Returns -1 when the input
+// ends in the middle of an escape sequence, unless flush is set, in which
+// case what is there is taken as a lone escape.
+int editorDecodeKey(int flush) {
+    if (E.pasting) return editorDecodePaste();
+    Ring &in = E.input;
+    if (in.size() == 0) return -1;
+    int c = in.at(0);
+    if (c != '\x1b') {
+        in.drop(1);
+        return c;
+    }
+    if (in.size() < 2) {
+        if (flush) in.drop(1);
+        return flush ? '\x1b' : -1;
+    }
+
+    int seq = in.at(1);
+    if (seq == 'O') {
+        if (in.size() < 3) {
+            if (flush) in.drop(2);
+            return flush ? '\x1b' : -1;
+        }
+        int final = in.at(2);
+        in.drop(3);
+        switch (final) {
+            case 'H': return HOME_KEY;
+            case 'F': return END_KEY;
         }
         return '\x1b';
-    } else {
-        return c;
     }
+    if (seq != '[') {
+        in.drop(2);
+        return '\x1b';
+    }
+
+    // CSI: parameter bytes, then a final byte
+    size_t j = 2;
+    int param = 0;
+    while (j < in.size() && in.at(j) >= 0x30 && in.at(j) <= 0x3f) {
+        if (j == 2 && isdigit(in.at(j))) param = in.at(j) - '0';
+        else if (isdigit(in.at(j)) && param >= 0) param = param * 10 + in.at(j) - '0';
+        else param = -1;
+        j++;
+    }
+    if (j == in.size()) {
+        if (flush) in.drop(j);
+        return flush ? '\x1b' : -1;
+    }
+    int final = in.at(j);
+    in.drop(j + 1);
+    if (final == '~') {
+        if (param == 200) {
+            E.pasting = 1;
+            E.pastematch = 0;
+            E.paste.clear();
+            return editorDecodePaste();
+        }
+        switch (param) {
+            case 1: return HOME_KEY;
+            case 2: return END_KEY;
+            case 3: return DEL_KEY;
+            case 5: return PAGE_UP;
+            case 6: return PAGE_DOWN;
+            case 7: return HOME_KEY;
+            case 8: return END_KEY;
+        }
+        return '\x1b';
+    }
+    switch (final) {
+        case 'A': return ARROW_UP;
+        case 'B': return ARROW_DOWN;
+        case 'C': return ARROW_RIGHT;
+        case 'D': return ARROW_LEFT;
+        case 'H': return HOME_KEY;
+        case 'F': return END_KEY;
+    }
+    return '\x1b';
+}
+
+int editorReadKey() {
+    int key = E.nextkey;
+    if (key != -1) {
+        E.nextkey = -1;
+        return key;
+    }
+    while ((key = editorDecodeKey(0)) == -1) {
+        if (E.input.size() == 0) {
+            if (E.headless) E.nokey();
+            else editorWaitEvents(-1);
+            continue;
+        }
+        // Headless, nothing more of the sequence can arrive
+        if (E.headless) return editorDecodeKey(1);
+        // Part of an escape sequence. If the rest does not follow shortly,
+        // it was the escape key.
+        long long deadline = editorNow() + GLYPH_ESC_TIMEOUT;
+        size_t have = E.input.size();
+        while (E.input.size() == have && editorNow() < deadline) {
+            editorWaitEvents(deadline - editorNow());
+        }
+        if (E.input.size() == have) return editorDecodeKey(1);
+    }
+    return key;
 }
 
 void editorMoveCursor(int key) {
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow *row = editorRowAt(E.cy);
     switch (key) {
         case ARROW_UP:
         if (E.cy != 0) E.cy--;
@@ -252,7 +666,7 @@ void editorMoveCursor(int key) {
             E.cx--;
         } else if (E.cy > 0) {
             E.cy--;
-            E.cx = E.row[E.cy].size;
+            E.cx = editorRowAt(E.cy) -> size;
         }
             break;
 
@@ -269,7 +683,7 @@ void editorMoveCursor(int key) {
         }
             break;
     }
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = editorRowAt(E.cy);
     int rowlen = row ? row -> size : 0;
     if (E.cx > rowlen) E.cx = rowlen;
 }
@@ -278,6 +692,13 @@ void editorProcessKey() {
     static int quit_count = GLYPH_QUIT_COUNT;
     int c = editorReadKey();
 
+    // Typing joins the undo step of the keys before it until a pause, any
+    // other key is a step of its own
+    int typing = c == BACKSPACE || c == DEL_KEY || c == CTRL_KEY('h') || c == '\t' || (c >= ' ' && c < 127);
+    long long now = editorNowUs();
+    if (!typing || now - E.lastkey > GLYPH_UNDO_PAUSE * 1000LL) E.undo.cut();
+    E.lastkey = now;
+
     switch(c) {
         case '\r':
             editorInsertNewLine();
@@ -290,8 +711,9 @@ void editorProcessKey() {
                 quit_count--;
                 return;
             }
-            write(STDOUT_FILENO, "\x1b[2J", 4);
-            write(STDOUT_FILENO, "\x1b[H", 3);
+            editorWriteOut("\x1b[2J", 4);
+            editorWriteOut("\x1b[H", 3);
+            editorShutdown();
             exit(0);
             break;
 
@@ -308,7 +730,7 @@ void editorProcessKey() {
 
         case END_KEY:
             if (E.cy < E.numrows) {
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy) -> size;
             }
             break;
 
@@ -316,6 +738,18 @@ void editorProcessKey() {
             editorFind();
             break;
 
+        case CTRL_KEY('r'):
+            editorReplace();
+            break;
+
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+
+        case CTRL_KEY('y'):
+            editorRedo();
+            break;
+
         case PAGE_UP:
         case PAGE_DOWN:
             {
@@ -334,6 +768,11 @@ void editorProcessKey() {
             editorSave();
             break;
 
+        case PASTE_KEY:
+            editorInsertText(E.paste.data(), E.paste.size());
+            std::string().swap(E.paste);
+            break;
+
         case CTRL_KEY('l'):
         case '\x1b':
             break;
@@ -349,10 +788,12 @@ void editorProcessKey() {
             editorInsertChar(c);
             break;
     }
+    if (!typing) E.undo.cut();
     quit_count = GLYPH_QUIT_COUNT;
 }
 
 int editorRowCxToRx(erow *row, int cx) {
+    if ((row -> valid & ROW_RENDER_VALID) && !(row -> special & ROW_TABS)) return cx;
     int rx = 0;
     int j;
     for (j = 0; j < cx; j++) {
@@ -364,6 +805,9 @@ int editorRowCxToRx(erow *row, int cx) {
 }
 
 int editorRowRxToCx(erow *row, int rx) {
+    if ((row -> valid & ROW_RENDER_VALID) && !(row -> special & ROW_TABS)) {
+        return rx < row -> size ? rx : row -> size;
+    }
     int cur_rx = 0;
     int cx;
     for (cx = 0; cx < row -> size; cx++) {
@@ -379,13 +823,12 @@ int is_separator(int c) {
   return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-void editorUpdateSyntax(erow *row) {
-    row -> hl = (unsigned char *)realloc(row -> hl, row -> rsize);
+// Highlights a row that starts with the given multiline comment state and
+// returns the state at its end
+int editorHighlightRow(erow *row, int in_comment) {
     memset(row -> hl, HL_NORMAL, row -> rsize);
 
-    if (E.syntax == NULL) return;
-
-    const char **keywords = E.syntax -> keywords;
+    if (E.syntax == NULL) return 0;
 
     const char *scs = E.syntax -> singleline_comment_start;
     const char *mcs = E.syntax -> multiline_comment_start;
@@ -397,7 +840,6 @@ void editorUpdateSyntax(erow *row) {
 
     int prev_sep = 1;
     int in_string = 0;
-    int in_comment = (row -> idx > 0 && E.row[row -> idx - 1].hl_open_comment);
 
     int i = 0;
     while (i < row -> rsize) {
@@ -464,20 +906,13 @@ void editorUpdateSyntax(erow *row) {
         }
 
         if (prev_sep) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                if (kw2) klen--;
-
-                if (!strncmp(&row -> render[i], keywords[j], klen) && 
-                is_separator(row -> render[klen + i])) {
-                    memset(&row -> hl[i], kw2 ? HL_KEYWORD_2 : HL_KEYWORD_1, klen);
-                    i += klen;
-                    break;
-                }
-            }
-            if (keywords[j] != NULL) {
+            // The whole word up to the next separator is looked up at once
+            int end = i;
+            while (!is_separator(row -> render[end])) end++;
+            int kind = E.syntax -> kwtable.lookup(&row -> render[i], end - i);
+            if (kind) {
+                memset(&row -> hl[i], kind == 2 ? HL_KEYWORD_2 : HL_KEYWORD_1, end - i);
+                i = end;
                 prev_sep = 0;
                 continue;
             }
@@ -486,60 +921,307 @@ void editorUpdateSyntax(erow *row) {
         i++;
     }
 
-    int changed = (row -> hl_open_comment != in_comment);
-    row -> hl_open_comment = in_comment;
-    if (changed && row -> idx + 1 < E.numrows) editorUpdateSyntax(&E.row[row -> idx + 1]);
+    return in_comment;
+}
+
+/*** Syntax State ***/
+// E.hlstate[r] records whether a multiline comment is still open at the end
+// of row r. These checkpoints are lexed by a worker thread straight from the
+// document, so a keystroke that opens a comment never waits for the rest of
+// the file. States are recorded for the rows below E.hlfront, and each one
+// follows from the state above it except for the rows in E.hldirty, which
+// the worker lexes again in order until the states stop changing.
+
+// Tracks only comment and string state, the way editorHighlightRow does
+int editorSyntaxScan(const char *s, size_t len, int in_comment) {
+    if (E.syntax == NULL) return 0;
+
+    const char *scs = E.syntax -> singleline_comment_start;
+    const char *mcs = E.syntax -> multiline_comment_start;
+    const char *mce = E.syntax -> multiline_comment_end;
+
+    size_t scs_length = scs ? strlen(scs) : 0;
+    size_t mcs_length = mcs ? strlen(mcs) : 0;
+    size_t mce_length = mce ? strlen(mce) : 0;
+
+    int in_string = 0;
+    size_t i = 0;
+    while (i < len) {
+        if (scs_length && !in_string && !in_comment) {
+            if (len - i >= scs_length && !memcmp(&s[i], scs, scs_length)) return 0;
+        }
+        if (mcs_length && mce_length && !in_string) {
+            if (in_comment) {
+                if (len - i >= mce_length && !memcmp(&s[i], mce, mce_length)) {
+                    i += mce_length;
+                    in_comment = 0;
+                } else {
+                    i++;
+                }
+                continue;
+            } else if (len - i >= mcs_length && !memcmp(&s[i], mcs, mcs_length)) {
+                i += mcs_length;
+                in_comment = 1;
+                continue;
+            }
+        }
+        if (E.syntax -> flags & HL_HIGHLIGHT_STRINGS) {
+            if (in_string) {
+                if (s[i] == '\\' && i + 1 < len) {
+                    i += 2;
+                    continue;
+                }
+                if (s[i] == in_string) in_string = 0;
+            } else if (s[i] == '"' || s[i] == '\'') {
+                in_string = s[i];
+            }
+        }
+        i++;
+    }
+    return in_comment;
+}
+
+// Whether the state at the end of row at is settled
+int editorSyntaxKnown(int at) {
+    if (at < 0) return 1;
+    return at < E.hlfront && (E.hldirty.empty() || *E.hldirty.begin() > at);
+}
+
+// The state at the start of row at changed, so its highlighting is stale
+void editorSyntaxStale(int at) {
+    erow *row = editorRowCached(at);
+    if (row) row -> valid &= ~ROW_HL_VALID;
+    if (at >= E.rowoff && at < E.rowoff + E.screenrows) E.hlrepaint = 1;
 }
 
-int editorSyntaxToColor(int hl) {
-    switch (hl) {
-        case (HL_MLCOMMENT):
-        case (HL_COMMENT): return 36;
-        case (HL_STRING): return 35;
-        case (HL_KEYWORD_1): return 33;
-        case (HL_KEYWORD_2): return 32;
-        case (HL_DIGIT): return 31;
-        case (HL_MATCH): return 34;
-        default: return 37;
+// Row at has to be lexed again because the state of the row above changed
+void editorSyntaxDirty(int at) {
+    if (at >= E.hlfront) return;
+    E.hldirty.insert(at);
+    editorSyntaxStale(at);
+    E.hlwake.notify_one();
+}
+
+// Renumbers dirty rows at or after at by delta
+void editorSyntaxShift(int at, int delta) {
+    auto first = E.hldirty.lower_bound(at);
+    std::vector<int> moved(first, E.hldirty.end());
+    E.hldirty.erase(first, E.hldirty.end());
+    for (int r : moved) E.hldirty.insert(r + delta);
+}
+
+// The worker keeps states settled down to a page below the viewport, so
+// paging down rarely shows a stale row. Rows further down wait until the
+// viewport gets near them.
+int editorSyntaxTarget() {
+    int target = E.rowoff + 2 * E.screenrows;
+    return target < E.numrows ? target : E.numrows;
+}
+
+// First row whose state is not settled
+int editorSyntaxNext() {
+    int at = E.hlfront;
+    if (!E.hldirty.empty() && *E.hldirty.begin() < at) at = *E.hldirty.begin();
+    return at;
+}
+
+// Lexes at most GLYPH_HL_BATCH rows from the first unsettled one, stopping
+// early once the states match what was recorded before. Returns 0 when there
+// is nothing left to do above the target.
+int editorSyntaxStep() {
+    TRACE_SCOPE("editorSyntaxStep");
+    int at = editorSyntaxNext();
+    int target = editorSyntaxTarget();
+    if (E.syntax == NULL || at >= target) return 0;
+    int end = at + GLYPH_HL_BATCH < target ? at + GLYPH_HL_BATCH : target;
+
+    int r = at;
+    int state = at > 0 ? E.hlstate[at - 1] : 0;
+    int carry = 1; // row r may start in a different state than it was lexed with
+    E.doc.forEachLine(at, end, [&](const char *s, size_t len) {
+        if (!carry) return;
+        if (len > 0 && s[len - 1] == '\r') len--;
+        state = editorSyntaxScan(s, len, state);
+        if (r < E.hlfront) {
+            E.hldirty.erase(r);
+            carry = (E.hlstate[r] != state);
+        } else {
+            E.hlfront = r + 1;
+        }
+        E.hlstate[r++] = state;
+        if (carry && r < E.hlfront) editorSyntaxStale(r);
+    });
+    if (carry) editorSyntaxDirty(r);
+    return 1;
+}
+
+// Rows drawn while their state was unknown are highlighted again once the
+// worker has caught up with the viewport
+void editorSyntaxSettled() {
+    if (!E.hlstale) return;
+    E.hlstale = 0;
+    for (erow *row : E.rows) row -> valid &= ~ROW_HL_VALID;
+    E.hlrepaint = 1;
+}
+
+void editorSyntaxWorker() {
+    traceThread("syntax");
+    std::unique_lock<std::mutex> guard(E.lock);
+    while (!E.hlquit) {
+        int more = editorSyntaxStep();
+        if (!more) editorSyntaxSettled();
+        // Rows in view changed, so the main thread has to redraw
+        if (E.hlrepaint) editorWake();
+        if (more) {
+            // Let a pending keystroke in between batches
+            guard.unlock();
+            std::this_thread::yield();
+            guard.lock();
+            continue;
+        }
+        E.hlwake.wait(guard);
     }
 }
 
+void editorStopSyntax() {
+    if (!E.hlworker.joinable()) return;
+    E.hlquit = 1;
+    E.hlwake.notify_one();
+    E.lock.unlock();
+    E.hlworker.join();
+}
+
+// From here on the main thread holds E.lock except while waiting for input
+void editorStartSyntax() {
+    E.lock.lock();
+    E.hlworker = std::thread(editorSyntaxWorker);
+    atexit(editorStopSyntax);
+}
+
+// Escape selecting the colour of each editorHighlight value. Values drawn in
+// the same colour share a string, so the draw loop can compare pointers.
+#define SGR_LEN 5
+static const char SGR_DEFAULT[] = "\x1b[39m";
+static const char SGR_RED[] = "\x1b[31m";
+static const char SGR_GREEN[] = "\x1b[32m";
+static const char SGR_YELLOW[] = "\x1b[33m";
+static const char SGR_BLUE[] = "\x1b[34m";
+static const char SGR_MAGENTA[] = "\x1b[35m";
+static const char SGR_CYAN[] = "\x1b[36m";
+
+static const char *const HL_SGR[HL_MATCH + 1] = {
+    SGR_DEFAULT, // HL_NORMAL
+    SGR_CYAN,    // HL_COMMENT
+    SGR_CYAN,    // HL_MLCOMMENT
+    SGR_YELLOW,  // HL_KEYWORD_1
+    SGR_GREEN,   // HL_KEYWORD_2
+    SGR_MAGENTA, // HL_STRING
+    SGR_RED,     // HL_DIGIT
+    SGR_BLUE,    // HL_MATCH
+};
+
 void editorSelectSyntaxHighlight() {
     E.syntax = NULL;
-    if (E.filename == NULL) return;
-
-    char *ext = strchr(E.filename, '.');
-
-    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-        struct editorSyntax *s = &HLDB[j];
-        unsigned int i = 0;
-        while (s -> filematch[i]) {
-            int is_ext = (s -> filematch[i][0] == '.');
-            if ((is_ext && ext && !strcmp(ext, s -> filematch[i])) || 
-            (!is_ext && strstr(E.filename, s -> filematch[i]))) {
-                E.syntax = s;
-                
-                int filerow;
-                for (filerow = 0; filerow < E.numrows; filerow++) {
-                    editorUpdateSyntax(&E.row[filerow]);
+    E.hlfront = 0;
+    E.hldirty.clear();
+    if (E.filename != NULL) {
+        char *ext = strchr(E.filename, '.');
+
+        for (unsigned int j = 0; j < HLDB_ENTRIES && !E.syntax; j++) {
+            struct editorSyntax *s = &HLDB[j];
+            unsigned int i = 0;
+            while (s -> filematch[i]) {
+                int is_ext = (s -> filematch[i][0] == '.');
+                if ((is_ext && ext && !strcmp(ext, s -> filematch[i])) || 
+                (!is_ext && strstr(E.filename, s -> filematch[i]))) {
+                    E.syntax = s;
+                    if (!s -> kwtable.built()) s -> kwtable.build(s -> keywords);
+                    break;
                 }
-                return;
+                i++;
             }
-            i++;
         }
     }
+
+    // States are lexed again from the top
+    for (erow *row : E.rows) row -> valid &= ~ROW_HL_VALID;
+    E.hlwake.notify_one();
 }
 /*** Output ***/
 void editorDrawStatusBar(Abuf& ab) {
     ab.append("\x1b[7m", 4);
-    char status[80], rstatus[80];
-
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", 
-    E.filename ? E.filename : "[Untitled]", E.numrows,
-    E.dirty ? "(modified)" : "");
+    char status[128], rstatus[160];
+
+    // "%.20s - %d%s lines %s", put together by hand as this runs every frame
+    const char *name = E.filename ? E.filename : "[Untitled]";
+    int len = strnlen(name, 20);
+    memcpy(status, name, len);
+    memcpy(&status[len], " - ", 3);
+    len += 3;
+    len += formatInt(&status[len], E.numrows);
+    if (E.loading) status[len++] = '+';
+    memcpy(&status[len], " lines ", 7);
+    len += 7;
+    if (E.dirty) {
+        memcpy(&status[len], "(modified)", 10);
+        len += 10;
+    }
+    if (E.saving) {
+        memcpy(&status[len], " saving ", 8);
+        len += 8;
+        size_t done = E.savedbytes;
+        len += formatInt(&status[len], E.savesize ? done * 100 / E.savesize : 100);
+        status[len++] = '%';
+    }
+    if (E.finding && !E.findquery.empty()) {
+        if (!E.findreerr.empty()) {
+            // Short fixed messages from Regex::compile
+            status[len++] = ' ';
+            memcpy(&status[len], E.findreerr.data(), E.findreerr.size());
+            len += E.findreerr.size();
+        } else if (!E.findready) {
+            memcpy(&status[len], " searching", 10);
+            len += 10;
+        } else if (E.findindex.empty()) {
+            memcpy(&status[len], " no matches", 11);
+            len += 11;
+        } else {
+            if (E.findcur != -1) {
+                memcpy(&status[len], " match ", 7);
+                len += 7;
+                len += formatInt(&status[len], E.findcur + 1);
+                memcpy(&status[len], " of ", 4);
+                len += 4;
+            } else {
+                status[len++] = ' ';
+            }
+            len += formatInt(&status[len], E.findindex.size());
+            if (E.findcapped) status[len++] = '+';
+            if (E.findcur == -1) {
+                memcpy(&status[len], " matches", 8);
+                len += 8;
+            }
+        }
+    }
 
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d%d", E.syntax ? E.syntax -> filetype : "None",
-    E.cy + 1, E.numrows);
+    int rlen = 0;
+    if (E.overlay) {
+        // The frame before this one, which is still being drawn
+        rlen += formatInt(&rstatus[rlen], E.frameus);
+        memcpy(&rstatus[rlen], "us ", 3);
+        rlen += 3;
+        rlen += formatInt(&rstatus[rlen], E.screen.frameBytes);
+        memcpy(&rstatus[rlen], "B | ", 4);
+        rlen += 4;
+    }
+    const char *filetype = E.syntax ? E.syntax -> filetype : "None";
+    int ftlen = strnlen(filetype, 40);
+    memcpy(&rstatus[rlen], filetype, ftlen);
+    rlen += ftlen;
+    memcpy(&rstatus[rlen], " | ", 3);
+    rlen += 3;
+    rlen += formatInt(&rstatus[rlen], E.cy + 1);
+    rlen += formatInt(&rstatus[rlen], E.numrows);
     
     if (len > E.screencols) len = E.screencols;
     ab.append(status, len);
@@ -553,14 +1235,12 @@ void editorDrawStatusBar(Abuf& ab) {
         }
     }
     ab.append("\x1b[m", 3);
-    ab.append("\r\n", 2);
 }
 
 void editorDrawStatusMessage(Abuf& ab) {
-    ab.append("\x1b[K", 3);
     int len = strlen(E.statusmsg);
     if (len > E.screencols) len = E.screencols;
-    if (len && time(NULL) - E.statusmsg_time < 5) ab.append(E.statusmsg, len);
+    if (len && time(NULL) - E.statusmsg_time < GLYPH_STATUS_TIMEOUT) ab.append(E.statusmsg, len);
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -569,98 +1249,166 @@ void editorSetStatusMessage(const char *fmt, ...) {
     vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
     va_end(ap);
     E.statusmsg_time = time(NULL);
+    // time() counts whole seconds, so the message may last up to one more
+    editorSetTimer((GLYPH_STATUS_TIMEOUT + 1) * 1000, editorRefreshScreen);
 }
 
 void editorScroll() {
     E.rx = 0;
     if (E.cy < E.numrows) {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
     }
     if (E.cy < E.rowoff) E.rowoff = E.cy;
     if (E.cy >= E.rowoff + E.screenrows) E.rowoff = E.cy - E.screenrows + 1;
     if (E.cx < E.coloff) E.coloff = E.rx;
     if (E.cx >= E.coloff + E.screencols) E.coloff = E.rx - E.screencols + 1;
 }
-void editorDrawRows(Abuf& ab); // Initialise function that will be defined later (this causes an error is omitted)
+// Writes screen line y unless the terminal already shows it
+void editorEmitLine(Abuf& ab, int y, const Abuf& line) {
+    if (!E.screen.update(y, line.data(), line.size())) return;
+    ab.append("\x1b[", 2);
+    ab.appendInt(y + 1);
+    ab.append(";1H", 3);
+    ab.append(line.data(), line.size());
+    ab.append("\x1b[K", 3);
+}
+
+// A pure vertical scroll is left to the terminal: the text area is made the
+// scrolling region and moved with SU/SD, so only the rows scrolled into view
+// are drawn afterwards
+void editorScrollRegion(Abuf& ab) {
+    int delta = E.screen.follow(E.rowoff, E.coloff, E.screenrows);
+    if (delta == 0) return;
+    ab.append("\x1b[1;", 4);
+    ab.appendInt(E.screenrows);
+    ab.append("r\x1b[", 3);
+    ab.appendInt(delta > 0 ? delta : -delta);
+    ab.append(delta > 0 ? "S" : "T", 1);
+    ab.append("\x1b[r", 3);
+    E.screen.scroll(E.screenrows, delta);
+}
+
+void editorDrawRows(Abuf& ab, Abuf& line); // Initialise function that will be defined later (this causes an error is omitted)
 void editorRefreshScreen() {
+    TRACE_SCOPE("editorRefreshScreen");
+    long long start = editorNowUs();
+    editorCancelTimer(editorFrameTimer);
+    E.lastframe = start / 1000;
+    editorPollLoad(0);
+    editorSyntaxFlush();
+    E.hlrepaint = 0;
     editorScroll();
-    Abuf AB = Abuf();
+    E.screen.resize(E.screenrows + 2);
+    // Both buffers live as long as the editor, sized for a colour change on
+    // every cell, so a frame normally allocates nothing
+    Abuf& AB = E.frame;
+    Abuf& line = E.line;
+    AB.clear();
+    line.reserve(E.screencols * (SGR_LEN + 1) + 32);
+    AB.reserve((E.screenrows + 2) * line.capacity());
     AB.append("\x1b[?25l", 6); // Erase cursor
-    AB.append("\x1b[H", 3); // Repositions the cursor
-    editorDrawRows(AB);
-    editorDrawStatusBar(AB);
-    editorDrawStatusMessage(AB);
-    
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy - E.rowoff + 1, E.rx - E.coloff + 1);
-    AB.append(buf, strlen(buf));
-
-    AB.append("\x1b[?25h", 6); // Draws cursor
-    write(STDOUT_FILENO, AB.data(), AB.size());
+    editorScrollRegion(AB);
+    editorDrawRows(AB, line);
+    line.clear();
+    editorDrawStatusBar(line);
+    editorEmitLine(AB, E.screenrows, line);
+    line.clear();
+    editorDrawStatusMessage(line);
+    editorEmitLine(AB, E.screenrows + 1, line);
+
+    // Only the lines that changed were drawn. When none did, at most the
+    // cursor has to move.
+    int changed = AB.size() > 6;
+    int row = E.cy - E.rowoff + 1, col = E.rx - E.coloff + 1;
+    size_t written = 0;
+    if (E.screen.moveCursor(row, col) || changed) {
+        AB.append("\x1b[", 2);
+        AB.appendInt(row);
+        AB.append(";", 1);
+        AB.appendInt(col);
+        AB.append("H", 1);
+        if (changed) AB.append("\x1b[?25h", 6); // Draws cursor
+        size_t from = changed ? 0 : 6;
+        written = AB.size() - from;
+        editorWriteOut(AB.data() + from, written);
+    }
+    E.screen.frame(written);
+    editorTrimRows();
+    E.frameus = editorNowUs() - start;
+    traceCounter("frame bytes", written);
+    traceCounter("row pool used", E.rowpool.stats().used);
 }
 
-void editorDrawRows(Abuf& ab) {
-    int y;
-    for (y = 0; y < E.screenrows; y++) {
-        int filerow = y + E.rowoff;
-        if (filerow >= E.numrows) {
-            if (E.numrows == 0 && y == E.screenrows / 2) {
-                char welcome[80];
-                int welcomelen = snprintf(welcome, sizeof(welcome),
-                    "Glyph Editor -- version %s", GLYPH_VERSION);
-                if (welcomelen > E.screencols) welcomelen = E.screencols;
-                int padding = (E.screencols - welcomelen) / 2;
-                if (padding) {
-                    ab.append("~", 1);
-                    padding--;
-                }
-                while (padding--) ab.append(" ", 1);
-                ab.append(welcome, welcomelen);
-            } else {
+// Replaces the contents of ab with the text of screen row y
+void editorDrawRow(Abuf& ab, int y) {
+    ab.clear();
+    int filerow = y + E.rowoff;
+    if (filerow >= E.numrows) {
+        if (E.numrows == 0 && y == E.screenrows / 2) {
+            const char welcome[] = "Glyph Editor -- version " GLYPH_VERSION;
+            int welcomelen = sizeof(welcome) - 1;
+            if (welcomelen > E.screencols) welcomelen = E.screencols;
+            int padding = (E.screencols - welcomelen) / 2;
+            if (padding) {
                 ab.append("~", 1);
+                padding--;
+            }
+            while (padding--) ab.append(" ", 1);
+            ab.append(welcome, welcomelen);
+        } else {
+            ab.append("~", 1);
+        }
+    } else {
+        erow *row = editorRowAt(filerow);
+        editorPrepareRow(row);
+        int len = row -> rsize - E.coloff;
+        if (len < 0) len = 0;
+        if (len > E.screencols) len = E.screencols;
+        char *c = &row -> render[E.coloff];
+        unsigned char *hl = &row -> hl[E.coloff];
+        const char *current_color = SGR_DEFAULT;
+        int j;
+        if (!(row -> special & ROW_CTRL)) {
+            // Nothing to escape, so each run of one colour is a single append
+            for (j = 0; j < len;) {
+                int k = j + 1;
+                while (k < len && hl[k] == hl[j]) k++;
+                const char *color = HL_SGR[hl[j]];
+                if (color != current_color) {
+                    current_color = color;
+                    ab.append(color, SGR_LEN);
+                }
+                ab.append(&c[j], k - j);
+                j = k;
             }
         } else {
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0) len = 0;
-            if (len > E.screencols) len = E.screencols;
-            char *c = &E.row[filerow].render[E.coloff];
-            unsigned char *hl = &E.row[filerow].hl[E.coloff];
-            int current_color = -1;
-            int j;
             for (j = 0; j < len; j++) {
                 if (iscntrl(c[j])) {
                     char sym = (c[j] <= 26) ? '@' + c[j] : '?';
                     ab.append("\x1b[7m", 4);
                     ab.append(&sym, 1);
                     ab.append("\x1b[m", 3);
-                    if (current_color != -1) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                        ab.append(buf, clen);
-                    }
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        ab.append("\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    ab.append(&c[j], 1);
+                    if (current_color != SGR_DEFAULT) ab.append(current_color, SGR_LEN);
                 } else {
-                    int color = editorSyntaxToColor(hl[j]);
+                    const char *color = HL_SGR[hl[j]];
                     if (color != current_color) {
                         current_color = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        ab.append(buf, clen);
+                        ab.append(color, SGR_LEN);
                     }
                     ab.append(&c[j], 1);
                 }
-                
             }
-            ab.append("\x1b[39m", 5);
         }
+        ab.append("\x1b[39m", 5);
+    }
+}
 
-        ab.append("\x1b[K", 3);
-        ab.append("\r\n", 2);
+void editorDrawRows(Abuf& ab, Abuf& line) {
+    TRACE_SCOPE("editorDrawRows");
+    int y;
+    for (y = 0; y < E.screenrows; y++) {
+        editorDrawRow(line, y);
+        editorEmitLine(ab, y, line);
     }
 }
 
@@ -670,7 +1418,10 @@ int getCursorPosition(int *rows, int *cols) {
 
     if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
 
+    // A terminal that does not answer gives up after 100 ms per byte
     while (i < sizeof(buf) - 1) {
+        struct pollfd fd = { STDIN_FILENO, POLLIN, 0 };
+        if (poll(&fd, 1, 100) != 1) break;
         if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
         if (buf[i] == 'R') break;
         i++;
@@ -695,79 +1446,288 @@ int getWindowSize(int *rows, int *cols) {
     }
 }
 
-void editorUpdateRow(erow *row) {
-    int tabs = 0;
-    int j;
-    for (j = 0; j < row -> size; j++)
-    if (row -> chars[j] == '\t') tabs++;
+void editorRenderRow(erow *row) {
+    size_t first = simdFindControl(row -> chars, row -> size);
+    size_t tabs = 0;
+    if (first != (size_t)row -> size) tabs = simdCountByte(row -> chars + first, row -> size - first, '\t');
+    editorRowReserve(row, row -> size, row -> size + tabs * (GLYPH_TAB_STOP - 1));
+    row -> special = 0;
+    row -> valid = (row -> valid & ROW_STATE_STALE) | ROW_RENDER_VALID;
+
+    // Rows without tabs or control bytes render as a straight copy
+    if (first == (size_t)row -> size) {
+        memcpy(row -> render, row -> chars, row -> size);
+        row -> render[row -> size] = '\0';
+        row -> rsize = row -> size;
+        return;
+    }
 
-    free(row -> render);
-    row->render = (char *)malloc(row -> size + (tabs * GLYPH_TAB_STOP - 1) + 1);
-    
-    int idx = 0;
-    for (j = 0; j < row -> size; j++) {
-        if (row -> chars[j] == '\t') {
-            row -> render[idx++] = ' ';
-            while (idx % GLYPH_TAB_STOP != 0) row -> render[idx++] = ' ';
-        } else {
-            row->render[idx++] = row->chars[j];
-        }
+    const char *p = row -> chars + first;
+    const char *end = row -> chars + row -> size;
+    memcpy(row -> render, row -> chars, first);
+
+    // Copy the runs between tabs in bulk
+    int idx = first;
+    while (p < end) {
+        const char *tab = tabs ? (const char *)memchr(p, '\t', end - p) : NULL;
+        size_t run = (tab ? tab : end) - p;
+        memcpy(&row -> render[idx], p, run);
+        idx += run;
+        if (tab == NULL) break;
+        row -> render[idx++] = ' ';
+        while (idx % GLYPH_TAB_STOP != 0) row -> render[idx++] = ' ';
+        p = tab + 1;
     }
     row->render[idx] = '\0';
     row->rsize = idx;
-    editorUpdateSyntax(row);
+
+    if (tabs) row -> special |= ROW_TABS;
+    if (simdFindControl(&row -> render[first], idx - first) != idx - first) row -> special |= ROW_CTRL;
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-    if (at < 0 || at > E.numrows) return;
+// render and hl are built only when a row is drawn or searched, and kept
+// until its chars or its starting comment state change
+void editorRenderedRow(erow *row) {
+    if (!(row -> valid & ROW_RENDER_VALID)) editorRenderRow(row);
+}
 
-    E.row = (erow* )realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows + 1));
-    for (int j = at + 1; j < E.numrows; j++) E.row[j].idx++;
-
-    E.row[at].idx = at;
-    E.row[at].size = len;
-    E.row[at].chars = (char* )malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
-
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
-    E.numrows++;
-    E.dirty++;
+// A row whose start state is not settled yet is highlighted with the best
+// guess at hand and redrawn when the worker catches up
+void editorPrepareRow(erow *row) {
+    editorRenderedRow(row);
+    if (row -> valid & ROW_HL_VALID) return;
+    int above = row -> idx - 1;
+    if (!editorSyntaxKnown(above)) E.hlstale = 1;
+    editorHighlightRow(row, above >= 0 && above < E.hlfront ? E.hlstate[above] : 0);
+    row -> valid |= ROW_HL_VALID;
+}
+
+// Called whenever chars change. The state at the end of the row is brought
+// up to date before the next frame, however many keys it took, and the rows
+// below are left to the worker.
+void editorUpdateRow(erow *row) {
+    int stale = row -> valid & ROW_STATE_STALE;
+    row -> valid = ROW_STATE_STALE;
+    if (!stale) E.hlpending.push_back(row);
+}
+
+void editorSyntaxFlush() {
+    TRACE_SCOPE("editorSyntaxFlush");
+    std::sort(E.hlpending.begin(), E.hlpending.end(),
+        [](const erow *a, const erow *b) { return a -> idx < b -> idx; });
+    for (erow *row : E.hlpending) {
+        row -> valid &= ~ROW_STATE_STALE;
+        int at = row -> idx;
+        if (at >= E.hlfront) continue;
+        int state = editorSyntaxScan(row -> chars, row -> size, at > 0 ? E.hlstate[at - 1] : 0);
+        if (state != E.hlstate[at]) {
+            E.hlstate[at] = state;
+            editorSyntaxDirty(at + 1);
+        }
+    }
+    E.hlpending.clear();
+}
+
+/*** Row Cache ***/
+// The piece table is the only copy of the text. An erow is a materialized
+// view of one line, built on first access and kept in a small cache sorted by
+// row index, so inserting or deleting a line only renumbers cached rows.
+
+static std::vector<erow *>::iterator editorRowSlot(int at) {
+    return std::lower_bound(E.rows.begin(), E.rows.end(), at,
+        [](const erow *row, int idx) { return row -> idx < idx; });
+}
+
+// Document offset of the first character of a row
+size_t editorRowOffset(int at) {
+    return E.doc.lineStart(at);
+}
+
+erow *editorRowCached(int at) {
+    auto slot = editorRowSlot(at);
+    return (slot != E.rows.end() && (*slot) -> idx == at) ? *slot : NULL;
+}
+
+erow *editorRowAt(int at) {
+    if (at < 0 || at >= E.numrows) return NULL;
+    auto slot = editorRowSlot(at);
+    if (slot != E.rows.end() && (*slot) -> idx == at) return *slot;
+
+    size_t start = editorRowOffset(at);
+    size_t len = editorRowOffset(at + 1) - 1 - start;
+
+    erow *row = (erow *)E.rowpool.alloc(sizeof(erow));
+    row -> idx = at;
+    row -> size = 0;
+    row -> rsize = 0;
+    row -> ccap = row -> rcap = 0;
+    row -> bsize = 0;
+    row -> chars = NULL;
+    row -> valid = 0;
+    editorRowReserve(row, len, len);
+    E.doc.copy(start, len, row -> chars);
+    // A CRLF line keeps its '\r' in the document, edits happen before it
+    if (len > 0 && row -> chars[len - 1] == '\r') len--;
+    row -> chars[len] = '\0';
+    row -> size = len;
+    E.rows.insert(slot, row);
+    return row;
+}
+
+// Makes room for csize chars and rsize rendered columns. A block that is
+// too small is replaced by one with slack, so typing into the row does not
+// come back here. Only chars moves over; render and hl are rebuilt.
+void editorRowReserve(erow *row, int csize, int rsize) {
+    if (csize < row -> ccap && rsize < row -> rcap) return;
+    if (rsize < csize) rsize = csize;
+    size_t cneed = csize + 1 + csize / 8 + GLYPH_ROW_SLACK;
+    size_t rneed = rsize + 1 + rsize / 8 + GLYPH_ROW_SLACK;
+    size_t cap = Pool::capacity(cneed + 2 * rneed);
+    size_t extra = cap - cneed - 2 * rneed;
+    char *block = (char *)E.rowpool.alloc(cap);
+    if (row -> chars) {
+        memcpy(block, row -> chars, row -> size + 1);
+        E.rowpool.release(row -> chars, row -> bsize);
+    }
+    row -> bsize = cap;
+    row -> ccap = cneed + extra / 3;
+    row -> rcap = (cap - row -> ccap) / 2;
+    row -> chars = block;
+    row -> render = block + row -> ccap;
+    row -> hl = (unsigned char *)row -> render + row -> rcap;
+    row -> valid &= ~(ROW_RENDER_VALID | ROW_HL_VALID);
 }
 
 void editorFreeRow(erow *row) {
-    free(row -> render);
-    free(row -> chars);
-    free(row -> hl);
+    E.rowpool.release(row -> chars, row -> bsize);
+    E.rowpool.release(row, sizeof(erow));
+}
+
+void editorRowMemoryStats(editorRowMemory *m) {
+    memset(m, 0, sizeof(*m));
+    for (const erow *row : E.rows) {
+        m -> rows++;
+        m -> chars += row -> size + 1;
+        m -> charsCap += row -> ccap;
+        if (row -> valid & ROW_RENDER_VALID) m -> render += row -> rsize + 1;
+        if (row -> valid & ROW_HL_VALID) m -> hl += row -> rsize;
+        m -> renderCap += row -> rcap;
+        m -> hlCap += row -> rcap;
+        m -> headers += Pool::capacity(sizeof(erow));
+    }
+    m -> pool = E.rowpool.stats();
+}
+
+// Renumbers cached rows at or after at by delta
+void editorShiftRows(int at, int delta) {
+    for (auto slot = editorRowSlot(at); slot != E.rows.end(); slot++) (*slot) -> idx += delta;
+}
+
+// Releases cached rows away from the viewport once the cache grows large
+void editorTrimRows() {
+    if (E.rows.size() <= GLYPH_ROW_CACHE) return;
+    int lo = E.rowoff - E.screenrows;
+    int hi = E.rowoff + 2 * E.screenrows;
+    size_t kept = 0;
+    for (size_t j = 0; j < E.rows.size(); j++) {
+        erow *row = E.rows[j];
+        if ((row -> idx >= lo && row -> idx < hi) || row -> idx == E.cy) {
+            E.rows[kept++] = row;
+        } else {
+            editorFreeRow(row);
+        }
+    }
+    E.rows.resize(kept);
+}
+
+void editorFreeRows() {
+    for (erow *row : E.rows) editorFreeRow(row);
+    E.rows.clear();
+    E.hlpending.clear();
+    E.rowpool.trim();
+}
+
+// Edits to the document go through these, so they are journaled
+void editorDocInsert(size_t off, const char *s, size_t len) {
+    E.undo.insert(off, s, len);
+    E.doc.insert(off, s, len);
+}
+
+void editorDocErase(size_t off, size_t len) {
+    std::string old(len, '\0');
+    E.doc.copy(off, len, &old[0]);
+    E.undo.erase(off, old.data(), len);
+    E.doc.erase(off, len);
+}
+
+void editorInsertRow(int at, const char *s, size_t len) {
+    if (at < 0 || at > E.numrows) return;
+    editorSyntaxFlush();
+
+    size_t off = editorRowOffset(at);
+    editorDocInsert(off, s, len);
+    editorDocInsert(off + len, E.crlf ? "\r\n" : "\n", E.crlf ? 2 : 1);
+
+    editorShiftRows(at, 1);
+    editorSyntaxShift(at, 1);
+    // Lex the new row from the state of the row above, so the change only
+    // spreads if the new row itself opens or closes a comment
+    int seed = at > 0 ? E.hlstate[at - 1] : 0;
+    int state = editorSyntaxScan(s, len, seed);
+    E.hlstate.insert(E.hlstate.begin() + at, state);
+    E.numrows++;
+    if (at < E.hlfront) {
+        E.hlfront++;
+        if (state != seed) editorSyntaxDirty(at + 1);
+    }
+    editorRowAt(at);
+    E.dirty++;
 }
 
 void editorDelRow(int at) {
     if (at < 0 || at >= E.numrows) return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    for (int j = at; j < E.numrows; j++) E.row[at].idx--;
+    editorSyntaxFlush();
+    size_t start = editorRowOffset(at);
+    editorDocErase(start, editorRowOffset(at + 1) - start);
+
+    auto slot = editorRowSlot(at);
+    if (slot != E.rows.end() && (*slot) -> idx == at) {
+        editorFreeRow(*slot);
+        E.rows.erase(slot);
+    }
+    editorShiftRows(at, -1);
+    int state = E.hlstate[at];
+    int dirty = E.hldirty.erase(at);
+    editorSyntaxShift(at + 1, -1);
+    E.hlstate.erase(E.hlstate.begin() + at);
     E.numrows--;
+    if (at < E.hlfront) {
+        E.hlfront--;
+        if (dirty || (at > 0 ? E.hlstate[at - 1] : 0) != state) editorSyntaxDirty(at);
+    }
     E.dirty++;
 }
 
 /*** Editor Operations ***/
-void editorRowInsertChar(erow *row, int at, int c) {
+void editorRowInsertString(erow *row, int at, const char *s, size_t len) {
     if (at < 0 || at > row -> size) at = row -> size;
-    row -> chars = (char *)realloc(row -> chars, row -> size + 2);
-    memmove(&row -> chars[at + 1], &row -> chars[at], row -> size - at + 1);
-    row -> size++;
-    row -> chars[at] = c;
+    editorDocInsert(editorRowOffset(row -> idx) + at, s, len);
+    editorRowReserve(row, row -> size + len, row -> size + len);
+    memmove(&row -> chars[at + len], &row -> chars[at], row -> size - at + 1);
+    memcpy(&row -> chars[at], s, len);
+    row -> size += len;
     editorUpdateRow(row);
     E.dirty++;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-    row -> chars = (char *)realloc(row -> chars, row -> size + len + 1);
+void editorRowInsertChar(erow *row, int at, int c) {
+    char ch = c;
+    editorRowInsertString(row, at, &ch, 1);
+}
+
+void editorRowAppendString(erow *row, const char *s, size_t len) {
+    editorDocInsert(editorRowOffset(row -> idx) + row -> size, s, len);
+    editorRowReserve(row, row -> size + len, row -> size + len);
     memcpy(&row -> chars[row -> size], s, len);
     row -> size += len;
     row -> chars [row -> size] = '\0';
@@ -776,7 +1736,8 @@ void editorRowAppendString(erow *row, char *s, size_t len) {
 }
 
 void editorRowDelChar(erow *row, int at) {
-    if (at < 0 || at > row -> size)  at = row -> size;
+    if (at < 0 || at >= row -> size) return;
+    editorDocErase(editorRowOffset(row -> idx) + at, 1);
     memmove(&row -> chars[at], &row -> chars[at + 1], row -> size - at);
     row -> size--;
     editorUpdateRow(row);
@@ -784,22 +1745,22 @@ void editorRowDelChar(erow *row, int at) {
 }
 
 void editorInsertChar(int c) {
-    char *emptyRow;
+    if (E.cy == E.numrows) editorWaitLoaded();
     if (E.cy == E.numrows) {
-        editorInsertRow(E.numrows, emptyRow, 0);
+        editorInsertRow(E.numrows, "", 0);
     }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
+    editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
     E.cx++;
 }
 
 void editorInsertNewLine() {
-    char *emptyRow;
+    if (E.cy == E.numrows) editorWaitLoaded();
     if (E.cx == 0) {
-        editorInsertRow(E.cy, emptyRow, 0);
+        editorInsertRow(E.cy, "", 0);
     } else {
-        erow *row = &E.row[E.cy];
+        erow *row = editorRowAt(E.cy);
         editorInsertRow(E.cy + 1, &row -> chars[E.cx], row -> size - E.cx);
-        row = &E.row[E.cy];
+        editorDocErase(editorRowOffset(E.cy) + E.cx, row -> size - E.cx);
         row -> size = E.cx;
         row -> chars[E.cx] = '\0';
         editorUpdateRow(row);
@@ -808,150 +1769,856 @@ void editorInsertNewLine() {
     E.cx = 0;
 }
 
+// Inserts text at the cursor as a single edit, as for a paste. The document
+// takes it in one insert and only the cursor row is rebuilt; the new rows
+// are materialized from the document when they come into view, and their
+// comment states are lexed straight from the text.
+void editorInsertText(const char *s, size_t len) {
+    if (len == 0) return;
+    if (E.cy == E.numrows) editorWaitLoaded();
+    if (E.cy == E.numrows) editorInsertRow(E.numrows, "", 0);
+    editorSyntaxFlush();
+    erow *row = editorRowAt(E.cy);
+
+    // Terminals send line breaks as CR, some as CRLF
+    std::string text;
+    text.reserve(len);
+    for (size_t j = 0; j < len; j++) {
+        if (s[j] == '\r') {
+            if (j + 1 < len && s[j + 1] == '\n') j++;
+            text.push_back('\n');
+        } else {
+            text.push_back(s[j]);
+        }
+    }
+    const char *p = text.data();
+    const char *end = p + text.size();
+    const char *nl = (const char *)memchr(p, '\n', end - p);
+    if (nl == NULL) {
+        editorRowInsertString(row, E.cx, p, end - p);
+        E.cx += end - p;
+        return;
+    }
+    int lines = std::count(text.begin(), text.end(), '\n');
+
+    int at = E.cy;
+    if (E.crlf) {
+        std::string crlf;
+        crlf.reserve(text.size() + lines);
+        for (char c : text) {
+            if (c == '\n') crlf.push_back('\r');
+            crlf.push_back(c);
+        }
+        editorDocInsert(editorRowOffset(at) + E.cx, crlf.data(), crlf.size());
+    } else {
+        editorDocInsert(editorRowOffset(at) + E.cx, p, end - p);
+    }
+
+    // The cursor row keeps what was before the cursor and gets the first
+    // pasted line; what was after the cursor ends the last one
+    std::string tail(&row -> chars[E.cx], row -> size - E.cx);
+    editorRowReserve(row, E.cx + (nl - p), E.cx + (nl - p));
+    memcpy(&row -> chars[E.cx], p, nl - p);
+    row -> size = E.cx + (nl - p);
+    row -> chars[row -> size] = '\0';
+    row -> valid = 0;
+
+    editorShiftRows(at + 1, lines);
+    editorSyntaxShift(at + 1, lines);
+    int endstate = E.hlstate[at];
+    E.hlstate.insert(E.hlstate.begin() + at + 1, lines, 0);
+    E.numrows += lines;
+    if (at < E.hlfront) {
+        E.hlfront += lines;
+        E.hldirty.erase(at);
+        int state = editorSyntaxScan(row -> chars, row -> size, at > 0 ? E.hlstate[at - 1] : 0);
+        E.hlstate[at] = state;
+        for (int r = at + 1; r < at + lines; r++) {
+            p = nl + 1;
+            nl = (const char *)memchr(p, '\n', end - p);
+            state = editorSyntaxScan(p, nl - p, state);
+            E.hlstate[r] = state;
+        }
+        std::string last(nl + 1, end - (nl + 1));
+        last += tail;
+        state = editorSyntaxScan(last.data(), last.size(), state);
+        E.hlstate[at + lines] = state;
+        if (state != endstate) editorSyntaxDirty(at + lines + 1);
+    }
+
+    const char *lastline = text.data() + text.rfind('\n') + 1;
+    E.cy = at + lines;
+    E.cx = end - lastline;
+    E.dirty++;
+}
+
 void editorDelChar() {
     if (E.cy == E.numrows) return;
     if (E.cx == 0 && E.cy == 0) return;
 
-    erow *row = &E.row[E.cy];
+    erow *row = editorRowAt(E.cy);
     if (E.cx > 0) {
         editorRowDelChar(row, E.cx - 1);
         E.cx--;
     } else {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row -> chars, row -> size);
+        erow *prev = editorRowAt(E.cy - 1);
+        E.cx = prev -> size;
+        editorRowAppendString(prev, row -> chars, row -> size);
         editorDelRow(E.cy);
         E.cy--;
     }
 }
 
-char *editorRowsToString(int *buflen) {
-    int totlen = 0;
-    for (int j = 0; j < E.numrows; j++) {
-        totlen += E.row[j].size + 1;
+char *editorRowsToString(size_t *buflen) {
+    *buflen = E.doc.length();
+    char *buf = (char *)malloc(*buflen ? *buflen : 1);
+    E.doc.copy(0, *buflen, buf);
+    return buf;
+}
+
+/*** Saving ***/
+// Ctrl-S snapshots the document as the list of its spans. Text in the piece
+// table is never overwritten, so the spans stay valid while editing goes on
+// and a background thread writes them out.
+
+// Writes iov[0, n) to fd in full, carrying on after short writes
+int editorWritev(int fd, struct iovec *iov, int n) {
+    while (n > 0) {
+        ssize_t w = writev(fd, iov, n);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (n > 0 && (size_t)w >= iov -> iov_len) {
+            w -= iov -> iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov -> iov_base = (char *)iov -> iov_base + w;
+            iov -> iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+// Streams spans[0, n) to fd GLYPH_SAVE_IOV at a time, adding to written
+// after each batch
+int editorWriteSpans(int fd, const struct iovec *spans, size_t n, std::atomic<size_t> &written) {
+    struct iovec iov[GLYPH_SAVE_IOV];
+    for (size_t j = 0; j < n; j += GLYPH_SAVE_IOV) {
+        int batch = n - j < GLYPH_SAVE_IOV ? n - j : GLYPH_SAVE_IOV;
+        size_t bytes = 0;
+        for (int k = 0; k < batch; k++) {
+            iov[k] = spans[j + k];
+            bytes += iov[k].iov_len;
+        }
+        if (editorWritev(fd, iov, batch) == -1) return -1;
+        written += bytes;
+    }
+    return 0;
+}
+
+// Writes spans[0, n) to a temporary file next to path, syncs it and renames
+// it over path, so the file on disk always holds either the old text or all
+// of the new. Returns -1 with errno set on failure.
+int editorWriteFile(const char *path, const struct iovec *spans, size_t n, std::atomic<size_t> &written) {
+    // Saving through a symlink replaces the file it points to
+    char *real = realpath(path, NULL);
+    const char *dest = real ? real : path;
+    const char *base = strrchr(dest, '/');
+    std::string dir = base ? std::string(dest, base == dest ? 1 : base - dest) : ".";
+    base = base ? base + 1 : dest;
+    std::string tmp = std::string(dest, base - dest) + "." + base + ".XXXXXX";
+
+    struct stat st;
+    int existed = (stat(dest, &st) == 0);
+    if (!existed) {
+        mode_t mask = umask(0);
+        umask(mask);
+        st.st_mode = 0666 & ~mask;
     }
-    *buflen = totlen;
-    char *buf = (char *)malloc(totlen);
-    char *p = buf;
 
-    for (int i = 0; i < E.numrows; i++) {
-        memcpy(p, E.row[i].chars, E.row[i].size);
-        p += E.row[i].size;
-        *p = '\n';
-        p++;
+    int fd = mkstemp(&tmp[0]);
+    if (fd == -1) {
+        free(real);
+        return -1;
     }
-    return buf;
+    // Keeps the owner when allowed to, otherwise the file becomes ours
+    if (existed && fchown(fd, st.st_uid, st.st_gid) == -1) errno = 0;
+    int ok = fchmod(fd, st.st_mode & 07777) == 0 && editorWriteSpans(fd, spans, n, written) == 0 && fsync(fd) == 0;
+    int err = errno;
+    if (close(fd) == -1 && ok) {
+        ok = 0;
+        err = errno;
+    }
+    if (ok && rename(tmp.c_str(), dest) == -1) {
+        ok = 0;
+        err = errno;
+    }
+    if (ok) {
+        int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dfd != -1) {
+            fsync(dfd);
+            close(dfd);
+        }
+    } else {
+        unlink(tmp.c_str());
+    }
+    free(real);
+    errno = err;
+    return ok ? 0 : -1;
+}
+
+void editorSaveWorker(std::string path) {
+    traceThread("saver");
+    TRACE_SCOPE("editorWriteFile");
+    int err = 0;
+    if (editorWriteFile(path.c_str(), E.savespans.data(), E.savespans.size(), E.savedbytes) == -1) err = errno;
+    E.saveerr = err;
+    E.saveus = editorNowUs() - E.savestart;
+    E.savedone = 1;
+}
+
+void editorFinishSave() {
+    E.saver.join();
+    E.saving = 0;
+    std::vector<struct iovec>().swap(E.savespans);
+    if (E.saveerr) {
+        editorSetStatusMessage("Saved failed! I/O error: %s", strerror(E.saveerr));
+        return;
+    }
+    // Edits made while the file was being written are still unsaved
+    E.cleanstate = E.savestate;
+    if (E.undo.state() == E.cleanstate) E.dirty = 0;
+    else E.dirty = E.dirty > E.savedirty ? E.dirty - E.savedirty : 1;
+    long long us = E.saveus;
+    editorSetStatusMessage("%zu bytes written to disk in %lld ms (%.1f MB/s)",
+        E.savesize, us / 1000, us > 0 ? (double)E.savesize / us : 0.0);
+}
+
+void editorSaveTimer() {
+    if (!E.saving) return;
+    if (E.savedone) editorFinishSave();
+    else editorSetTimer(GLYPH_SAVE_POLL, editorSaveTimer);
+    editorScheduleRefresh();
+}
+
+// A save still running at exit is finished, so the file is never left
+// half way
+void editorStopSave() {
+    if (E.saver.joinable()) E.saver.join();
 }
 
 void editorSave() {
+    TRACE_SCOPE("editorSave");
+    if (E.saving) {
+        editorSetStatusMessage("Already saving");
+        return;
+    }
     if (E.filename == NULL) {
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL, 0);
         if (E.filename == NULL) {
             editorSetStatusMessage("Save aborted");
             return;
         }
         editorSelectSyntaxHighlight();
     }
-    int len;
-    char *buf = editorRowsToString(&len);
-
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
+    editorWaitLoaded();
+    E.savespans.clear();
+    E.doc.forEachSpan(0, E.doc.length(), [](const char *s, size_t len) {
+        E.savespans.push_back(iovec{ (void *)s, len });
+    });
+    E.savesize = E.doc.length();
+    E.savedbytes = 0;
+    E.savedone = 0;
+    E.saveerr = 0;
+    E.savedirty = E.dirty;
+    E.undo.cut();
+    E.savestate = E.undo.state();
+    E.savestart = editorNowUs();
+    E.saving = 1;
+    E.saver = std::thread(editorSaveWorker, std::string(E.filename));
+    static int registered = 0;
+    if (!registered) {
+        atexit(editorStopSave);
+        registered = 1;
+    }
+    editorSetTimer(GLYPH_SAVE_POLL, editorSaveTimer);
+}
+
+/*** File Loading ***/
+// Files are mmap'd and their newlines indexed in the background. Each poll
+// attaches the lines indexed so far to the end of the document, so the first
+// screen appears at once and rows only come into being once they exist.
+
+int editorPollLoad(int wait) {
+    if (!E.loading) return 0;
+    TRACE_SCOPE("editorPollLoad");
+    std::vector<size_t> nl;
+    size_t scanned = E.indexer.take(nl, E.crlfrows, wait);
+    int done = (scanned == E.docsize);
+    size_t end = E.doc.attachedOriginal();
+    if (done) end = E.docsize;
+    else if (!nl.empty()) end = nl.back() + 1;
+    else return 0;
+
+    E.doc.appendOriginal(nl.data(), nl.size(), end);
+    E.crlf = (E.crlfrows * 2 > E.doc.lineCount());
+    if (done) {
+        E.loading = 0;
+        // Every row ends in a newline in the document, as it does on disk
+        if (end > 0 && E.docbuf[end - 1] != '\n') {
+            E.doc.insert(E.doc.length(), E.crlf ? "\r\n" : "\n", E.crlf ? 2 : 1);
         }
-        close(fd);
     }
-    free(buf);
-    editorSetStatusMessage("Saved failed! I/O error: %s", strerror(errno));
+    E.numrows = E.doc.lineCount();
+    E.hlstate.resize(E.numrows, 0);
+    return 1;
+}
+
+// Shows rows as they get indexed
+void editorLoadTimer() {
+    if (editorPollLoad(0)) editorScheduleRefresh();
+    if (E.loading) editorSetTimer(GLYPH_LOAD_POLL, editorLoadTimer);
+}
+
+// Appending a row or reading the whole document needs the complete file
+void editorWaitLoaded() {
+    while (E.loading) editorPollLoad(1);
+}
+
+void editorReleaseDocBuf() {
+    E.indexer.stop();
+    E.loading = 0;
+    E.doc.clear();
+    if (E.docmapped) munmap(E.docbuf, E.docsize);
+    else free(E.docbuf);
+    E.docbuf = NULL;
+    E.docsize = 0;
+    E.docmapped = 0;
 }
 
 void openEditor(char *filename) {
+    TRACE_SCOPE("openEditor");
     free(E.filename);
     E.filename = strdup(filename);
 
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) die("open");
+    struct stat st;
+    if (fstat(fd, &st) == -1) die("fstat");
+
+    editorFreeRows();
+    editorReleaseDocBuf();
+    if (st.st_size > 0) {
+        E.docbuf = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (E.docbuf == MAP_FAILED) die("mmap");
+        E.docsize = st.st_size;
+        E.docmapped = 1;
+    }
+    close(fd);
+
+    E.numrows = 0;
+    E.crlfrows = 0;
+    E.hlstate.clear();
     editorSelectSyntaxHighlight();
-    FILE *fp = fopen(filename, "r");
-    if (!fp) die ("fopen");
-
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        while (linelen > 0 && line[linelen - 1] == '\r' || line[linelen - 1] == '\n') linelen--;
-        editorInsertRow(E.numrows, line, linelen);
-    }
-    free(line);
-    fclose(fp);
+    E.doc.openDeferred(E.docbuf, E.docsize);
+    E.indexer.start(E.docbuf, E.docsize);
+    E.loading = 1;
+    editorSetTimer(GLYPH_LOAD_POLL, editorLoadTimer);
+    // Only the first screenful has to be indexed before drawing
+    while (E.loading && E.numrows <= E.screenrows) editorPollLoad(1);
+    E.undo.clear();
+    E.cleanstate = E.undo.state();
     E.dirty = 0;
 }
 
 /*** Search ***/
-void editorFindCallBack(char *query, int key) {
-    static int last_match = -1;
-    static int direction = 1;
+// Queries are matched against the document text itself, a span of the piece
+// table at a time. A match that runs across two spans is found in the seam:
+// the last length - 1 bytes before the span joined to its first length - 1.
+
+// Offset of the first match inside the document range [from, to), or npos
+size_t editorDocFind(const SearchPattern &pat, size_t from, size_t to) {
+    size_t found = SearchPattern::npos;
+    SearchStream stream(pat, from);
+    E.doc.forEachSpan(from, to - from, [&](const char *s, size_t n) {
+        if (found != SearchPattern::npos) return;
+        stream.feed(s, n, [&](size_t off) {
+            found = off;
+            return false;
+        });
+    });
+    return found;
+}
+
+// Offset of the last match inside the document range [from, to), or npos
+size_t editorDocFindLast(const SearchPattern &pat, size_t from, size_t to) {
+    size_t m = pat.length();
+    size_t found = SearchPattern::npos;
+    size_t base = to;
+    std::string seam;
+    E.doc.forEachSpanReverse(from, to - from, [&](const char *s, size_t n) {
+        if (found != SearchPattern::npos) return;
+        base -= n;
+        size_t head = seam.size();
+        if (head > 0) {
+            size_t take = n < m - 1 ? n : m - 1;
+            seam.insert(0, s + n - take, take);
+            size_t at = pat.rfind(seam.data(), seam.size());
+            if (at != SearchPattern::npos) {
+                found = base + n - take + at;
+                return;
+            }
+            seam.erase(0, take);
+        }
+        size_t at = pat.rfind(s, n);
+        if (at != SearchPattern::npos) {
+            found = base + at;
+            return;
+        }
+        if (n >= m - 1) {
+            seam.assign(s, m - 1);
+        } else {
+            seam.insert(0, s, n);
+            seam.resize(m - 1 < seam.size() ? m - 1 : seam.size());
+        }
+    });
+    return found;
+}
+
+// Offset of the first regex match at from, or with past set after it, or
+// npos. Matches are listed from from on, which is 0 or a match found before,
+// so they are the ones the match index holds without going over the ones
+// earlier in the line again.
+size_t editorDocFindRegex(Regex &re, size_t from, bool past) {
+    size_t found = SearchPattern::npos;
+    size_t start = E.doc.lineStart(E.doc.lineOf(from));
+    RegexStream stream(re, start, from);
+    auto first = [&](size_t off) {
+        if (past && off == from) return true;
+        found = off;
+        return false;
+    };
+    bool going = true;
+    E.doc.forEachSpan(start, E.doc.length() - start, [&](const char *s, size_t n) {
+        if (going) going = stream.feed(s, n, first);
+    });
+    if (going) stream.finish(first);
+    return found;
+}
+
+// Offset of the last regex match that starts before before, or npos. The
+// document is scanned forwards a block of whole lines at a time, going back
+// a block until one holds a match. The listing stops at before, so the rest
+// of its line is not matched.
+size_t editorDocFindRegexLast(Regex &re, size_t before) {
+    size_t found = SearchPattern::npos;
+    size_t to = before;
+    while (to > 0 && found == SearchPattern::npos) {
+        size_t from = to > GLYPH_FIND_BLOCK ? to - GLYPH_FIND_BLOCK : 0;
+        from = E.doc.lineStart(E.doc.lineOf(from));
+        size_t end = E.doc.lineStart(E.doc.lineOf(to - 1) + 1);
+        RegexStream stream(re, from);
+        auto last = [&](size_t off) {
+            if (off >= before) return false;
+            found = off;
+            return true;
+        };
+        bool going = true;
+        E.doc.forEachSpan(from, end - from, [&](const char *s, size_t n) {
+            if (going) going = stream.feed(s, n, last);
+        });
+        if (going) stream.finish(last);
+        to = from;
+    }
+    return found;
+}
+
+/*** Match Index ***/
+// Every match of the query is indexed in the background, so the status bar
+// can count them and next and previous are a step through a sorted array.
+// The document is snapshot as its spans and split into one byte range per
+// thread. A new query cancels the running finders, which check between
+// blocks of GLYPH_FIND_BLOCK bytes.
+//
+// While the query is being typed, every match of the longer query is also a
+// match of the shorter one, so only those offsets are checked again. The
+// indexes of the shorter queries are kept in findlevels, and backspace goes
+// back to them without scanning at all.
+//
+// A regular expression is indexed the same way, with the ranges ending at
+// line starts since its matches never span lines. Its levels are not kept:
+// a longer pattern may match more, as "a" and "a|b" do.
+
+// Indexes the matches that start in [from, to) into findparts[part]
+void editorFindWorker(unsigned gen, size_t part, size_t from, size_t to) {
+    traceThread("finder");
+    TRACE_SCOPE("editorFindWorker");
+    std::vector<size_t> &out = E.findparts[part];
+    size_t m = E.findpat.length();
+    size_t end = E.findstarts.back();
+    end = to + m - 1 < end ? to + m - 1 : end;
+    size_t cap = GLYPH_FIND_MAX / E.findparts.size() + 1;
+    SearchStream stream(E.findpat, from);
+    size_t j = std::upper_bound(E.findstarts.begin(), E.findstarts.end(), from) - E.findstarts.begin() - 1;
+    size_t off = from;
+    int going = 1;
+    while (going && off < end && E.findgen == gen) {
+        const struct iovec &span = E.findspans[j];
+        size_t in = off - E.findstarts[j];
+        size_t n = span.iov_len - in;
+        if (n > end - off) n = end - off;
+        if (n > GLYPH_FIND_BLOCK) n = GLYPH_FIND_BLOCK;
+        going = stream.feed((const char *)span.iov_base + in, n, [&](size_t at) {
+            if (at >= to || out.size() == cap) return false;
+            out.push_back(at);
+            return true;
+        });
+        off += n;
+        if (off == E.findstarts[j + 1]) j++;
+    }
+    E.findpending--;
+}
+
+// Indexes the regex matches that start in [from, to), which are whole lines,
+// into findparts[part]
+void editorFindRegexWorker(unsigned gen, size_t part, size_t from, size_t to) {
+    traceThread("finder");
+    TRACE_SCOPE("editorFindRegexWorker");
+    std::vector<size_t> &out = E.findparts[part];
+    size_t cap = GLYPH_FIND_MAX / E.findparts.size() + 1;
+    Regex re = E.findre; // with DFA caches of its own
+    re.cancelWhen(&E.findgen, gen); // so a long line does not hold up a stop
+    RegexStream stream(re, from);
+    auto add = [&](size_t at) {
+        if (out.size() == cap) return false;
+        out.push_back(at);
+        return true;
+    };
+    size_t j = std::upper_bound(E.findstarts.begin(), E.findstarts.end(), from) - E.findstarts.begin() - 1;
+    size_t off = from;
+    bool going = true;
+    while (going && off < to && E.findgen == gen) {
+        const struct iovec &span = E.findspans[j];
+        size_t in = off - E.findstarts[j];
+        size_t n = span.iov_len - in;
+        if (n > to - off) n = to - off;
+        if (n > GLYPH_FIND_BLOCK) n = GLYPH_FIND_BLOCK;
+        going = stream.feed((const char *)span.iov_base + in, n, add);
+        off += n;
+        if (off == E.findstarts[j + 1]) j++;
+    }
+    if (going && off == to) stream.finish(add);
+    E.findpending--;
+}
+
+// Keeps the candidates in [from, to) that are matches of the query, into
+// findparts[part]
+void editorFindRecheckWorker(unsigned gen, size_t part, const std::vector<size_t> *candidates,
+        size_t from, size_t to) {
+    std::vector<size_t> &out = E.findparts[part];
+    size_t m = E.findpat.length();
+    size_t total = E.findstarts.back();
+    std::string gather;
+    size_t j = 0;
+    for (size_t k = from; k < to; k++) {
+        if ((k - from) % GLYPH_FIND_RECHECK == 0 && E.findgen != gen) break;
+        size_t at = (*candidates)[k];
+        if (at + m > total) break;
+        while (E.findstarts[j + 1] <= at) j++;
+        const struct iovec &span = E.findspans[j];
+        size_t in = at - E.findstarts[j];
+        const char *text = (const char *)span.iov_base + in;
+        if (in + m > span.iov_len) {
+            // Runs across spans
+            gather.clear();
+            for (size_t i = j; gather.size() < m; i++) {
+                size_t skip = (i == j) ? in : 0;
+                size_t n = E.findspans[i].iov_len - skip;
+                if (n > m - gather.size()) n = m - gather.size();
+                gather.append((const char *)E.findspans[i].iov_base + skip, n);
+            }
+            text = gather.data();
+        }
+        if (E.findpat.matches(text)) out.push_back(at);
+    }
+    E.findpending--;
+}
+
+// Stops the finders, leaving the index as it was
+void editorFindStop() {
+    E.findgen++;
+    for (std::thread &t : E.finders) t.join();
+    E.finders.clear();
+    E.findparts.clear();
+    E.findpending = 0;
+}
+
+// Stops the finders and forgets the index
+void editorFindCancel() {
+    editorFindStop();
+    E.findindex.clear();
+    E.findready = 0;
+    E.findcapped = 0;
+    E.findcur = -1;
+}
+
+// Gathers the index once the finders are done. Returns whether it is ready.
+int editorFindCollect() {
+    if (E.findready) return 1;
+    if (E.findpending > 0) return 0;
+    for (std::thread &t : E.finders) t.join();
+    E.finders.clear();
+    size_t cap = GLYPH_FIND_MAX / (E.findparts.empty() ? 1 : E.findparts.size()) + 1;
+    for (std::vector<size_t> &part : E.findparts) {
+        E.findindex.insert(E.findindex.end(), part.begin(), part.end());
+        if (part.size() == cap) E.findcapped = 1;
+    }
+    E.findparts.clear();
+    std::vector<struct iovec>().swap(E.findspans);
+    E.findready = 1;
+    auto at = std::lower_bound(E.findindex.begin(), E.findindex.end(), E.findmatch);
+    E.findcur = (at != E.findindex.end() && *at == E.findmatch) ? at - E.findindex.begin() : -1;
+    return 1;
+}
+
+void editorFindTimer() {
+    if (!E.finding || E.findready) return;
+    if (editorFindCollect()) editorScheduleRefresh();
+    else editorSetTimer(GLYPH_FIND_POLL, editorFindTimer);
+}
+
+// Starts indexing the matches of E.findpat, or E.findre
+void editorFindStart() {
+    size_t total = E.findstarts.back();
+    size_t threads = std::thread::hardware_concurrency();
+    if (threads == 0) threads = 1;
+    size_t chunk = (total + threads - 1) / threads;
+    if (chunk < GLYPH_FIND_CHUNK) chunk = GLYPH_FIND_CHUNK;
+    size_t parts = (total + chunk - 1) / chunk;
+    if (parts == 0) parts = 1;
+    E.findparts.assign(parts, std::vector<size_t>());
+    E.findpending = parts;
+    unsigned gen = E.findgen;
+    void (*worker)(unsigned, size_t, size_t, size_t) = E.findregex ? editorFindRegexWorker : editorFindWorker;
+    if (total <= GLYPH_FIND_CHUNK) {
+        // Not worth a thread
+        worker(gen, 0, 0, total);
+        editorFindCollect();
+        return;
+    }
+    std::vector<size_t> bounds(parts + 1, total);
+    for (size_t p = 1; p < parts; p++) {
+        bounds[p] = p * chunk < total ? p * chunk : total;
+        if (E.findregex) bounds[p] = E.doc.lineStart(E.doc.lineOf(bounds[p]));
+    }
+    bounds[0] = 0;
+    for (size_t p = 0; p < parts; p++) {
+        E.finders.emplace_back(worker, gen, p, bounds[p], bounds[p + 1]);
+    }
+    editorSetTimer(GLYPH_FIND_POLL, editorFindTimer);
+}
+
+// Starts keeping the candidates that match E.findpat
+void editorFindRecheck(const std::vector<size_t> &candidates) {
+    size_t count = candidates.size();
+    size_t threads = std::thread::hardware_concurrency();
+    if (threads == 0) threads = 1;
+    size_t chunk = (count + threads - 1) / threads;
+    if (chunk < GLYPH_FIND_RECHECK) chunk = GLYPH_FIND_RECHECK;
+    size_t parts = (count + chunk - 1) / chunk;
+    if (parts == 0) parts = 1;
+    E.findparts.assign(parts, std::vector<size_t>());
+    E.findpending = parts;
+    unsigned gen = E.findgen;
+    if (count <= GLYPH_FIND_RECHECK) {
+        editorFindRecheckWorker(gen, 0, &candidates, 0, count);
+        editorFindCollect();
+        return;
+    }
+    for (size_t p = 0; p < parts; p++) {
+        size_t to = (p + 1) * chunk < count ? (p + 1) * chunk : count;
+        E.finders.emplace_back(editorFindRecheckWorker, gen, p, &candidates, p * chunk, to);
+    }
+    editorSetTimer(GLYPH_FIND_POLL, editorFindTimer);
+}
+
+// Snapshots the document as its spans for the finders
+void editorFindSnapshot() {
+    size_t total = E.doc.length();
+    E.findspans.clear();
+    E.findstarts.clear();
+    E.doc.forEachSpan(0, total, [](const char *s, size_t n) {
+        E.findstarts.push_back(E.findstarts.empty() ? 0 : E.findstarts.back() + E.findspans.back().iov_len);
+        E.findspans.push_back(iovec{ (void *)s, n });
+    });
+    E.findstarts.push_back(total);
+}
 
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
+// Indexes the matches of query, from the index of a shorter query when
+// there is one. With regex set, query is a regular expression.
+void editorFindQuery(const char *query, int icase, int regex) {
+    editorFindStop();
+    std::string q = query;
+    if (regex || E.findregex || icase != E.findpat.ignoresCase()) E.findlevels.clear();
+    // A finished index whose query q extends becomes a level
+    else if (E.findready && !E.findcapped && !E.findquery.empty() &&
+            q.compare(0, E.findquery.size(), E.findquery) == 0) {
+        E.findlevels.push_back(editorFindLevel{ E.findquery, std::move(E.findindex) });
+    }
+    while (!E.findlevels.empty()) {
+        const std::string &lq = E.findlevels.back().query;
+        if (q.size() >= lq.size() && q.compare(0, lq.size(), lq) == 0) break;
+        E.findlevels.pop_back();
+    }
+    editorFindCancel();
+    E.findquery = q;
+    E.findregex = regex;
+    E.findreerr.clear();
+    if (regex) {
+        if (q.empty() || !E.findre.compile(q.data(), q.size(), icase, E.findreerr)) return;
+        editorFindSnapshot();
+        editorFindStart();
+        return;
+    }
+    E.findpat.compile(q.data(), q.size(), icase);
+    if (q.empty()) return;
+    if (!E.findlevels.empty() && E.findlevels.back().query == q) {
+        E.findindex = std::move(E.findlevels.back().index);
+        E.findlevels.pop_back();
+        E.findready = 1;
+        return;
+    }
+    editorFindSnapshot();
+    if (!E.findlevels.empty()) editorFindRecheck(E.findlevels.back().index);
+    else editorFindStart();
+}
+
+/*** Find ***/
+// The prompt names the case mode and whether the query is a regular
+// expression, which Ctrl-T and Ctrl-R switch while searching
+static int find_icase = 0;
+static int find_regex = 0;
+static char find_prompt[64];
 
-    if (saved_hl) {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
+void editorFindPrompt() {
+    snprintf(find_prompt, sizeof(find_prompt), "Search: %%s (ESC/Arrows/Enter, ^T: %s, ^R: %s)",
+        find_icase ? "any case" : "match case", find_regex ? "regex" : "text");
+}
+
+// The match after, or with direction -1 before, the current one
+size_t editorFindNext(int direction) {
+    size_t len = E.doc.length();
+    size_t m = E.findpat.length();
+    if (E.findregex && !E.findre.compiled()) return SearchPattern::npos;
+    if (E.findmatch == SearchPattern::npos) {
+        return E.findregex ? editorDocFindRegex(E.findre, 0, false) : editorDocFind(E.findpat, 0, len);
+    }
+    if (editorFindCollect() && !E.findcapped) {
+        if (E.findindex.empty()) return SearchPattern::npos;
+        long n = E.findindex.size();
+        long k = E.findcur;
+        if (k == -1) {
+            // Next from where the cursor was, which is not a match
+            k = std::lower_bound(E.findindex.begin(), E.findindex.end(), E.findmatch) - E.findindex.begin();
+            if (direction == 1) k--;
+        }
+        E.findcur = ((k + direction) % n + n) % n;
+        return E.findindex[E.findcur];
     }
+    size_t match;
+    if (E.findregex) {
+        if (direction == 1) {
+            match = editorDocFindRegex(E.findre, E.findmatch, true);
+            if (match == SearchPattern::npos) match = editorDocFindRegex(E.findre, 0, false);
+        } else {
+            match = editorDocFindRegexLast(E.findre, E.findmatch);
+            if (match == SearchPattern::npos) match = editorDocFindRegexLast(E.findre, len);
+        }
+    } else if (direction == 1) {
+        match = editorDocFind(E.findpat, E.findmatch + 1, len);
+        if (match == SearchPattern::npos) match = editorDocFind(E.findpat, 0, len);
+    } else {
+        match = editorDocFindLast(E.findpat, 0, E.findmatch + m - 1);
+        if (match == SearchPattern::npos) match = editorDocFindLast(E.findpat, 0, len);
+    }
+    return match;
+}
 
+void editorFindCallBack(char *query, int key) {
+    TRACE_SCOPE("editorFindCallBack");
+    static int saved_hl_line = -1;
+
+    // The match colouring goes away when the row is highlighted again
+    if (saved_hl_line != -1) {
+        erow *row = editorRowCached(saved_hl_line);
+        if (row) row -> valid &= ~ROW_HL_VALID;
+        saved_hl_line = -1;
+    }
+
+    int direction = 1;
     if (key == '\r' || key == '\x1b') {
-        last_match = -1;
-        direction = 1;
+        editorFindCancel();
+        E.findlevels.clear();
+        E.findquery.clear();
+        E.finding = 0;
         return;
     } else if (key == ARROW_DOWN || key == ARROW_RIGHT) {
         direction = 1;
     } else if (key == ARROW_LEFT || key == ARROW_UP) {
         direction = -1;
     } else {
-        last_match = -1;
-        direction = 1;
+        if (key == CTRL_KEY('t')) {
+            find_icase = !find_icase;
+            editorFindPrompt();
+        } else if (key == CTRL_KEY('r')) {
+            find_regex = !find_regex;
+            editorFindPrompt();
+        } else if (E.findquery == query) {
+            // A key that did not change the query
+            return;
+        }
+        editorFindQuery(query, find_icase, find_regex);
+        E.findmatch = SearchPattern::npos;
     }
 
-    if (last_match == -1) direction = 1;
-    int current = last_match;
-
-    int i;
-    for (i = 0; i < E.numrows; i++) {
-        current += direction;
-        if (current == -1) current = E.numrows - 1;
-        else if (current == E.numrows) current = 0;
-    
-        erow *row = &E.row[current];
-        char *match = strstr(row -> render, query);
-        if (match) {
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row -> render);
-            E.rowoff = E.numrows;
-
-            saved_hl_line = current;
-            saved_hl = (char *)malloc(row -> rsize);
-            memcpy(saved_hl, row -> hl, row -> rsize);
-
-            memset(&row -> hl[match - row -> render], HL_MATCH, strlen(query));
-            break;
-        }
+    size_t match = editorFindNext(direction);
+    if (match == SearchPattern::npos) return;
+    if (E.findready && E.findcur == -1) {
+        E.findcur = std::lower_bound(E.findindex.begin(), E.findindex.end(), match) - E.findindex.begin();
     }
+    E.findmatch = match;
+
+    // Neither queries nor regex matches hold line breaks, so the match lies
+    // within one row
+    int current = E.doc.lineOf(match);
+    erow *row = editorRowAt(current);
+    int cx = match - E.doc.lineStart(current);
+    editorPrepareRow(row);
+    E.cy = current;
+    E.cx = cx;
+    E.rowoff = E.numrows;
+
+    saved_hl_line = current;
+    int rx = editorRowCxToRx(row, cx);
+    size_t len = E.findregex ? E.findre.matchAt(row -> chars, row -> size, cx) : E.findpat.length();
+    memset(&row -> hl[rx], HL_MATCH, editorRowCxToRx(row, cx + len) - rx);
 }
 
 void editorFind() {
+    editorWaitLoaded();
     int saved_cx = E.cx;
     int saved_cy = E.cy;
     int saved_coloff = E.coloff;
     int saved_rowoff = E.rowoff;
 
-    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallBack);
+    E.finding = 1;
+    E.findmatch = SearchPattern::npos;
+    E.findpat.compile("", 0, find_icase);
+    editorFindPrompt();
+    char *query = editorPrompt(find_prompt, editorFindCallBack, 0);
     if (query) {
         free(query);
     } else {
@@ -962,13 +2629,328 @@ void editorFind() {
     }
 }
 
+/*** Replace ***/
+// Replace all finds every match with the finders of the match index, then
+// goes through the rows that hold one to skip overlaps and size regex
+// matches. The edits go to the piece table as one batch, so the document is
+// rebuilt once whatever the number of matches. Rows are materialized again
+// as they come into view.
+
+void editorReplacePrompt() {
+    snprintf(find_prompt, sizeof(find_prompt), "Replace: %%s (ESC/Enter, ^T: %s, ^R: %s)",
+        find_icase ? "any case" : "match case", find_regex ? "regex" : "text");
+}
+
+void editorReplaceCallBack(char *, int key) {
+    if (key == CTRL_KEY('t')) find_icase = !find_icase;
+    else if (key == CTRL_KEY('r')) find_regex = !find_regex;
+    else return;
+    editorReplacePrompt();
+}
+
+// Waits for the finders and gathers the index
+void editorFindWait() {
+    for (std::thread &t : E.finders) t.join();
+    E.finders.clear();
+    editorFindCollect();
+}
+
+// Makes a batch of edits that neither add nor remove line breaks, as
+// replace-all and its undo do. Edits close to each other are joined, copying
+// the text between them, so that dense matches make few pieces. Then the
+// rows they touch are lexed, and only those whose comment state changed
+// send the worker further down.
+void editorApplyEdits(const std::vector<ptEdit> &edits, const char *text) {
+    editorSyntaxFlush();
+    std::vector<ptEdit> joined;
+    std::string out;
+    for (const ptEdit &e : edits) {
+        size_t last = joined.empty() ? 0 : joined.back().off + joined.back().len;
+        if (!joined.empty() && e.off - last <= GLYPH_REPLACE_GAP) {
+            size_t gap = e.off - last;
+            out.resize(out.size() + gap);
+            E.doc.copy(last, gap, &out[out.size() - gap]);
+            joined.back().len += gap + e.len;
+        } else {
+            joined.push_back(ptEdit{ e.off, e.len, out.size(), 0 });
+        }
+        out.append(text + e.start, e.n);
+        joined.back().n = out.size() - joined.back().start;
+    }
+    E.doc.replace(joined, out);
+
+    size_t shift = 0;
+    int next = 0; // rows above are lexed
+    for (const ptEdit &e : joined) {
+        size_t off = e.off + shift;
+        shift += e.n - e.len;
+        int r = E.doc.lineOf(off);
+        if (r < next) r = next;
+        int last = E.doc.lineOf(off + e.n);
+        if (r >= E.hlfront) break;
+        if (last >= E.hlfront) last = E.hlfront - 1;
+        E.doc.forEachLine(r, last + 1, [&](const char *s, size_t len) {
+            if (len > 0 && s[len - 1] == '\r') len--;
+            int state = editorSyntaxScan(s, len, r > 0 ? E.hlstate[r - 1] : 0);
+            if (state != E.hlstate[r]) {
+                E.hlstate[r] = state;
+                editorSyntaxDirty(r + 1);
+            }
+            r++;
+        });
+        next = last + 1;
+    }
+    editorFreeRows();
+    if (E.cy < E.numrows) {
+        erow *row = editorRowAt(E.cy);
+        if (E.cx > row -> size) E.cx = row -> size;
+    }
+}
+
+// Replaces the matches in E.findindex with with[0, wlen), as one undo step.
+// Returns how many were replaced, and sets *rows to the number of rows they
+// were in.
+size_t editorReplaceMatches(const char *with, size_t wlen, int *rows) {
+    TRACE_SCOPE("editorReplaceMatches");
+    std::vector<ptEdit> matches;
+    std::vector<std::pair<size_t, size_t>> spans; // regex matches in the line
+    std::string old, line;
+    size_t m = E.findpat.length();
+    *rows = 0;
+    size_t k = 0;
+    while (k < E.findindex.size()) {
+        int r = E.doc.lineOf(E.findindex[k]);
+        size_t start = E.doc.lineStart(r);
+        size_t len = E.doc.lineStart(r + 1) - start;
+        if ((size_t)r < E.doc.lineCount()) len--;
+        line.resize(len);
+        E.doc.copy(start, len, &line[0]);
+        // Matches stop short of a CRLF line's '\r', so the line ending stays
+        size_t text = len > 0 && line[len - 1] == '\r' ? len - 1 : len;
+        // Regex match lengths come from one pass over the line
+        spans.clear();
+        if (E.findregex) {
+            E.findre.lineMatches(line.data(), text, [&](size_t at, size_t n) {
+                spans.push_back({ at, n });
+                return true;
+            });
+        }
+        size_t pos = 0, next = 0;
+        for (; k < E.findindex.size() && E.findindex[k] < start + len; k++) {
+            size_t at = E.findindex[k] - start;
+            if (at < pos) continue; // overlaps the one before
+            size_t n = m;
+            if (E.findregex) {
+                while (next < spans.size() && spans[next].first < at) next++;
+                n = next < spans.size() && spans[next].first == at ? spans[next].second : 0;
+            }
+            if (n == 0) continue;
+            matches.push_back(ptEdit{ start + at, n, 0, wlen });
+            old.append(line, at, n);
+            pos = at + n;
+        }
+        (*rows)++;
+    }
+    E.undo.cut();
+    E.undo.replace(matches, old.data(), with, wlen);
+    E.undo.cut();
+    editorApplyEdits(matches, with);
+    if (!matches.empty()) E.dirty++;
+    return matches.size();
+}
+
+void editorReplace() {
+    editorWaitLoaded();
+    editorReplacePrompt();
+    char *query = editorPrompt(find_prompt, editorReplaceCallBack, 0);
+    if (query == NULL) return;
+    // An empty replacement deletes the matches
+    char *with = editorPrompt("With: %s (ESC to cancel)", NULL, PROMPT_ALLOW_EMPTY);
+    if (with == NULL) {
+        free(query);
+        return;
+    }
+
+    long long start = editorNowUs();
+    editorFindQuery(query, find_icase, find_regex);
+    editorFindWait();
+    if (!E.findreerr.empty()) {
+        editorSetStatusMessage("Bad pattern: %s", E.findreerr.c_str());
+    } else if (E.findcapped) {
+        editorSetStatusMessage("Too many matches to replace");
+    } else if (E.findindex.empty()) {
+        editorSetStatusMessage("No matches");
+    } else {
+        int rows;
+        size_t replaced = editorReplaceMatches(with, strlen(with), &rows);
+        editorSetStatusMessage("Replaced %zu matches in %d rows in %lld ms", replaced, rows,
+            (editorNowUs() - start) / 1000);
+    }
+    editorFindCancel();
+    E.findlevels.clear();
+    E.findquery.clear();
+    free(query);
+    free(with);
+}
+
+/*** Undo ***/
+// Every edit is recorded in E.undo as it is made to the document (see
+// editorDocInsert). Undo and redo replay the journal's changes straight onto
+// the document, then bring the rows, their count and the comment states in
+// line with it, lexing only the rows a change touched. The document is clean
+// whenever the journal is back at the step that was last saved.
+
+// Rows at to at + removed were replaced by rows at to at + added
+void editorTextChanged(int at, int removed, int added) {
+    int delta = added - removed;
+    size_t kept = 0;
+    for (erow *row : E.rows) {
+        if (row -> idx >= at && row -> idx <= at + removed) {
+            editorFreeRow(row);
+            continue;
+        }
+        if (row -> idx > at + removed) row -> idx += delta;
+        E.rows[kept++] = row;
+    }
+    E.rows.resize(kept);
+
+    // The row after the last is empty and has a state too, for the time being
+    E.hlstate.push_back(E.hlstate.empty() ? 0 : E.hlstate.back());
+    int endstate = E.hlstate[at + removed];
+    E.hldirty.erase(E.hldirty.upper_bound(at), E.hldirty.upper_bound(at + removed));
+    editorSyntaxShift(at + removed + 1, delta);
+    if (delta > 0) E.hlstate.insert(E.hlstate.begin() + at + 1, delta, 0);
+    else E.hlstate.erase(E.hlstate.begin() + at + 1, E.hlstate.begin() + at + 1 - delta);
+    E.numrows += delta;
+    if (at + removed < E.hlfront) {
+        E.hlfront += delta;
+        int r = at;
+        int state = at > 0 ? E.hlstate[at - 1] : 0;
+        E.hldirty.erase(at);
+        E.doc.forEachLine(at, at + added + 1, [&](const char *s, size_t len) {
+            if (len > 0 && s[len - 1] == '\r') len--;
+            state = editorSyntaxScan(s, len, state);
+            E.hlstate[r++] = state;
+        });
+        if (state != endstate) editorSyntaxDirty(at + added + 1);
+    } else if (at < E.hlfront) {
+        E.hlfront = at;
+        E.hldirty.erase(E.hldirty.lower_bound(at), E.hldirty.end());
+    }
+    E.hlstate.pop_back();
+    E.hlwake.notify_one();
+}
+
+void editorTextInsert(size_t off, const char *s, size_t len) {
+    editorSyntaxFlush();
+    int at = E.doc.lineOf(off);
+    E.doc.insert(off, s, len);
+    editorTextChanged(at, 0, std::count(s, s + len, '\n'));
+}
+
+void editorTextErase(size_t off, size_t len) {
+    editorSyntaxFlush();
+    int at = E.doc.lineOf(off);
+    int lines = 0;
+    E.doc.forEachSpan(off, len, [&](const char *s, size_t n) {
+        lines += std::count(s, s + n, '\n');
+    });
+    E.doc.erase(off, len);
+    editorTextChanged(at, lines, 0);
+}
+
+// Makes a change from the journal. Returns the offset the cursor goes to.
+size_t editorApplyChange(const jrChange &c) {
+    if (c.kind == JR_INSERT) {
+        editorTextInsert(c.off, c.text, c.len);
+        return c.off + c.len;
+    } else if (c.kind == JR_ERASE) {
+        editorTextErase(c.off, c.len);
+        return c.off;
+    }
+    editorApplyEdits(*c.edits, c.text);
+    return c.edits -> front().off;
+}
+
+void editorUndoneTo(size_t off) {
+    E.cy = E.doc.lineOf(off);
+    E.cx = off - E.doc.lineStart(E.cy);
+    if (E.cy < E.numrows) {
+        erow *row = editorRowAt(E.cy);
+        if (E.cx > row -> size) E.cx = row -> size;
+    }
+    E.dirty = E.undo.state() == E.cleanstate ? 0 : E.dirty + 1;
+}
+
+void editorUndo() {
+    TRACE_SCOPE("editorUndo");
+    editorWaitLoaded();
+    size_t off = 0;
+    if (!E.undo.undo([&](const jrChange &c) { off = editorApplyChange(c); })) {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    editorUndoneTo(off);
+}
+
+void editorRedo() {
+    TRACE_SCOPE("editorRedo");
+    editorWaitLoaded();
+    size_t off = 0;
+    if (!E.undo.redo([&](const jrChange &c) { off = editorApplyChange(c); })) {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+    editorUndoneTo(off);
+}
+
 /*** Init ***/
+// Joins every thread the editor started and writes the trace, if one is
+// being recorded. Called on the way out, before exit.
+void editorShutdown() {
+    editorFindStop();
+    E.indexer.stop();
+    editorStopSave();
+    editorStopSyntax();
+    if (traceOn) traceDump();
+}
+
 void initEditor() {
     E.cx = 0;
     E.cy = 0;
     E.rx = 0;
     E.numrows = 0;
-    E.row = NULL;
+    E.docbuf = NULL;
+    E.docsize = 0;
+    E.docmapped = 0;
+    E.loading = 0;
+    E.crlfrows = 0;
+    E.crlf = 0;
+    E.hlfront = 0;
+    E.hlstale = 0;
+    E.hlrepaint = 0;
+    E.hlquit = 0;
+    E.winch = 0;
+    E.pasting = 0;
+    E.pastematch = 0;
+    E.nextkey = -1;
+    E.lastframe = 0;
+    E.saving = 0;
+    E.finding = 0;
+    E.findregex = 0;
+    E.findpending = 0;
+    E.findready = 0;
+    E.findcapped = 0;
+    E.findmatch = SearchPattern::npos;
+    E.findcur = -1;
+    const char *fps = getenv("GLYPH_FPS");
+    int rate = fps ? atoi(fps) : GLYPH_MAX_FPS;
+    E.frameinterval = rate > 0 ? 1000 / rate : 0;
+    // Threads started from here on are traced too
+    const char *trace = getenv("GLYPH_TRACE");
+    if (trace && *trace) traceStart(trace);
+    E.overlay = getenv("GLYPH_OVERLAY") != NULL;
+    E.frameus = 0;
     E.rowoff = 0;
     E.coloff = 0;
     E.filename = NULL;
@@ -976,23 +2958,32 @@ void initEditor() {
     E.statusmsg_time = 0;
     E.dirty = 0;
     E.syntax = NULL;
-    if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+    // Headless, the harness has set the size already
+    if (!E.headless && getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
     E.screenrows -= 2;
 }
 
+// bench/replay.cpp brings its own main
+#ifndef GLYPH_NO_MAIN
 int main(int argc, char *argv[]) {
     enableRawMode();
     initEditor();
+    editorInitEvents();
+    editorStartSyntax();
     if (argc >= 2) {
         openEditor(argv[1]);
     }
-    editorSetStatusMessage("HELP: Ctrl-S = Save | Ctrl-Q = Quit | Ctrl-F = Find");
+    editorSetStatusMessage("HELP: Ctrl-S Save | Ctrl-Q Quit | Ctrl-F Find | Ctrl-R Replace | Ctrl-Z Undo");
 
-    // Quit terminal when 'q' is typed.
+    // Keys that are already waiting are all handled before the next frame,
+    // so a key held down never builds up a backlog of frames
+    editorRefreshScreen();
     while (1) {
-        editorRefreshScreen();
         editorProcessKey();
+        while (editorInputPending()) editorProcessKey();
+        editorScheduleRefresh();
     }
 
     return 0;
-}
\ No newline at end of file
+}
+#endif